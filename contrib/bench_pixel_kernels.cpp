@@ -0,0 +1,116 @@
+// Microbenchmark of pixel kernels (src/util/pixel_kernels.cpp) on a single 256x256 chunk.
+// Every implementation (scalar, SSE2, AVX2) is measured, not only the one selected at runtime.
+//
+// Build: meson setup build -Dbenchmarks=true && ninja -C build bench_pixel_kernels
+// or:    g++ -O2 -std=c++17 -include pch.hpp -Isrc contrib/bench_pixel_kernels.cpp src/chunk_image.cpp -o bench_pixel_kernels
+
+// Per-ISA variants are static, compiled into this file
+#include "util/pixel_kernels.cpp"
+
+#include "chunk_image.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static constexpr u32 chunk_pixels = 256 * 256;
+
+static volatile u32 sink;
+
+///@returns microseconds per call
+template <typename Callback>
+static double measure(u32 repeats, Callback &&callback) {
+	auto start = std::chrono::steady_clock::now();
+	for(u32 i = 0; i < repeats; i++)
+		callback();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count() / repeats;
+}
+
+static bool checkDiffMask(const u8 *a, const u8 *b, u32 pixel_count) {
+	std::vector<u64> expected((pixel_count + 63) / 64), mask(expected.size());
+	u32 expected_count = rgbDiffMaskScalar(a, b, pixel_count, expected.data());
+
+	auto check = [&](u32 (*diff_mask)(const u8 *, const u8 *, u32, u64 *)) {
+		std::fill(mask.begin(), mask.end(), 0);
+		return diff_mask(a, b, pixel_count, mask.data()) == expected_count && mask == expected;
+	};
+
+	bool ok = true;
+#ifdef PIXEL_KERNELS_X86
+	ok &= check(rgbDiffMaskSSE2);
+	if(__builtin_cpu_supports("avx2"))
+		ok &= check(rgbDiffMaskAVX2);
+#endif
+	return ok;
+}
+
+int main() {
+	srand(1);
+
+	// Few colors (like drawings), 200 changed bytes between a and b
+	std::vector<u8> a(chunk_pixels * 3);
+	for(auto &byte : a)
+		byte = rand() % 4 * 60;
+	std::vector<u8> b = a;
+	for(u32 i = 0; i < 200; i++)
+		b[rand() % b.size()] ^= 0x55;
+
+	std::vector<u8> white(chunk_pixels * 3, 255);
+	std::vector<u64> mask(chunk_pixels / 64);
+
+	printf("Selected kernels: %s\n", getPixelKernelsName());
+
+	// Odd length covers the scalar tail of SIMD versions
+	if(!checkDiffMask(a.data(), b.data(), chunk_pixels - 5)) {
+		printf("Diff mask results differ between implementations\n");
+		return 1;
+	}
+
+	const u32 repeats = 20000;
+	bool has_avx2 = false;
+#ifdef PIXEL_KERNELS_X86
+	has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	printf("Times per call (us), 256x256 chunk:\n");
+
+	printf("  diff mask, 200 changed bytes: scalar %.1f", measure(repeats, [&] {
+					 sink = rgbDiffMaskScalar(a.data(), b.data(), chunk_pixels, mask.data());
+				 }));
+#ifdef PIXEL_KERNELS_X86
+	printf(", sse2 %.1f", measure(repeats, [&] {
+					 sink = rgbDiffMaskSSE2(a.data(), b.data(), chunk_pixels, mask.data());
+				 }));
+	if(has_avx2) {
+		printf(", avx2 %.1f", measure(repeats, [&] {
+						 sink = rgbDiffMaskAVX2(a.data(), b.data(), chunk_pixels, mask.data());
+					 }));
+	}
+#endif
+	printf("\n");
+
+	printf("  uniform check, white chunk: scalar %.1f", measure(repeats, [&] {
+					 sink = rgbIsUniformScalar(white.data(), chunk_pixels, Color(255, 255, 255));
+				 }));
+#ifdef PIXEL_KERNELS_X86
+	printf(", sse2 %.1f", measure(repeats, [&] {
+					 sink = rgbIsUniformSSE2(white.data(), chunk_pixels, Color(255, 255, 255));
+				 }));
+	if(has_avx2) {
+		printf(", avx2 %.1f", measure(repeats, [&] {
+						 sink = rgbIsUniformAVX2(white.data(), chunk_pixels, Color(255, 255, 255));
+					 }));
+	}
+#endif
+	printf("\n");
+
+	// Same image blitted again at an unaligned offset, every tile is partially covered and mostly unchanged
+	ChunkImage image;
+	image.loadRGB(a.data());
+	printf("  ChunkImage::setRect, unaligned 240x240 re-blit (%s): %.1f\n", getPixelKernelsName(), measure(200, [&] {
+					 sink = image.setRect(8, 8, 240, 240, a.data() + (8 * 256 + 8) * 3, 256 * 3).count();
+				 }));
+
+	return 0;
+}
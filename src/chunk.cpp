@@ -5,17 +5,38 @@
 #include "room.hpp"
 #include "server.hpp"
 #include "session.hpp"
+#include "util/pixel_kernels.hpp"
 #include <cassert>
+#include <cstring>
 
-Chunk::Chunk(ChunkSystem *chunk_system, Int2 position, SharedVector<u8> compressed_chunk_data)
+Chunk::Chunk(ChunkSystem *chunk_system, Int2 position)
 		: chunk_system(chunk_system),
 			position(position) {
+}
+
+void Chunk::finishLoading(SharedVector<u8> compressed_chunk_data) {
 	LockGuard lock(mtx_access);
 	this->compressed_image = compressed_chunk_data;
+	this->compressed_image_hc = true; // Loaded from database
 
 	new_chunk = true;
 	if(compressed_chunk_data && !compressed_chunk_data->empty())
 		new_chunk = false;
+
+	loading = false;
+
+	// Sessions linked while loading didn't get chunk data yet
+	for(auto *session : linked_sessions)
+		sendChunkDataToSession_nolock(session);
+}
+
+bool Chunk::isLoading() const {
+	return loading;
+}
+
+void Chunk::waitUntilLoaded() {
+	if(loading)
+		chunk_system->waitForChunkLoad(this);
 }
 
 Chunk::~Chunk() {
@@ -29,52 +50,146 @@ u32 Chunk::getImageSizeBytes() const {
 	return ChunkSystem::getChunkSize() * ChunkSystem::getChunkSize() * 3; /*RGB*/
 }
 
+// Temporary raw RGB buffer used for (de)compression, reused between calls on the same thread
+static u8 *getRawImageBuffer(u32 size) {
+	static thread_local uniqdata<u8> buffer;
+	if(buffer.size() < size)
+		buffer.resize(size);
+	return buffer.data();
+}
+
+// Shared, read-only image of a blank (white) chunk
+static const ChunkImage &getBlankImage() {
+	static ChunkImage blank_image;
+	return blank_image;
+}
+
+const ChunkImage *Chunk::getImageForRead_nolock() {
+	if(!image && new_chunk)
+		return &getBlankImage(); // Never written, do not allocate anything
+
+	return acquireImage_nolock();
+}
+
+ChunkImage *Chunk::acquireImage_nolock() {
+	if(image) {
+		image_cache_hits++;
+	} else {
+		if(compressed_image && !new_chunk)
+			image_cache_misses++;
+		allocateImage_nolock();
+	}
+
+	image_last_access = chunk_system->getTicks();
+	return image.get();
+}
+
 void Chunk::allocateImage_nolock() {
 	if(!image) {
-		image = createSharedVector<u8>(getImageSizeBytes());
-		new_chunk = false;
+		image.create();
 
-		if(compressed_image) {
-			decompressLZ4(compressed_image->data(), compressed_image->size(), image->data(), image->size());
-		} else {
-			memset(image->data(), 255, image->size()); // White
+		if(compressed_image && !new_chunk) {
+			auto *rgb = getRawImageBuffer(getImageSizeBytes());
+			decompressLZ4(compressed_image->data(), compressed_image->size(), rgb, getImageSizeBytes());
+			image->loadRGB(rgb);
 		}
+		// Otherwise all tiles are white already
 	}
 }
 
+bool Chunk::evictImage_nolock() {
+	// Image can be dropped only if it can be restored from compressed data,
+	// modified tiles not sent yet are read from it by the next flush
+	if(!image || modified || !compressed_image || in_flush_list || dirty_tiles_unsent.any())
+		return false;
+
+	image.reset();
+	return true;
+}
+
 void Chunk::getPixel_nolock(UInt2 chunk_pixel_pos, Color *color) {
 	assert(chunk_pixel_pos.x < ChunkSystem::getChunkSize());
 	assert(chunk_pixel_pos.y < ChunkSystem::getChunkSize());
-	auto *rgb = image->data();
-	size_t offset = chunk_pixel_pos.y * ChunkSystem::getChunkSize() * 3 + chunk_pixel_pos.x * 3;
-	color->r = rgb[offset + 0];
-	color->g = rgb[offset + 1];
-	color->b = rgb[offset + 2];
+	getImageForRead_nolock()->getPixel(chunk_pixel_pos.x, chunk_pixel_pos.y, color);
+}
+
+void Chunk::getPixels_nolock(const ChunkPixel *pixels, u32 count, Color *colors) {
+	auto *read_image = getImageForRead_nolock();
+	for(u32 i = 0; i < count; i++) {
+		auto &pos = pixels[i].pos;
+		assert(pos.x < ChunkSystem::getChunkSize());
+		assert(pos.y < ChunkSystem::getChunkSize());
+		read_image->getPixel(pos.x, pos.y, &colors[i]);
+	}
+}
+
+void Chunk::getRGB_nolock(u8 *rgb) {
+	getImageForRead_nolock()->storeRGB(rgb);
+}
+
+bool Chunk::writePixel_nolock(UInt2 chunk_pixel_pos, Color color) {
+	if(!image && new_chunk) {
+		// Copy-on-write, allocate image on the first real change only
+		Color current;
+		getBlankImage().getPixel(chunk_pixel_pos.x, chunk_pixel_pos.y, &current);
+		if(current == color)
+			return false;
+	}
+
+	if(!acquireImage_nolock()->setPixel(chunk_pixel_pos.x, chunk_pixel_pos.y, color))
+		return false;
+
+	markModified_nolock(chunk_pixel_pos);
+	return true;
 }
 
 static SharedVector<u8> compressed_empty_chunk;
 static Mutex mtx_empty_chunk;
 
 // Returns LZ4-compressed empty, white chunk. Generates once.
-SharedVector<u8> getEmptyChunk(Chunk *chunk) {
+SharedVector<u8> getEmptyChunk(Chunk *chunk, s32 level) {
 	LockGuard lock(mtx_empty_chunk);
 	if(!compressed_empty_chunk) {
 		uniqdata<u8> stub_img(chunk->getImageSizeBytes());
 		memset(stub_img.data(), 255, stub_img.size_bytes());
-		compressed_empty_chunk = compressLZ4(stub_img.data(), stub_img.size_bytes());
+		compressed_empty_chunk = compressLZ4HC(stub_img.data(), stub_img.size_bytes(), level);
 	}
 	return compressed_empty_chunk;
 }
 
-SharedVector<u8> Chunk::encodeChunkData_nolock() {
+SharedVector<u8> Chunk::encodeChunkData_nolock(bool for_storage) {
+	auto &settings = chunk_system->room->settings.compression;
+
+	// Cached data is good enough if it was compressed for storage or storage quality isn't required
+	if(compressed_image && (compressed_image_hc || !for_storage))
+		return compressed_image;
+
 	SharedVector<u8> compressed;
 
 	if(new_chunk) {
 		// Return compressed empty chunk
-		compressed = getEmptyChunk(this);
+		compressed = getEmptyChunk(this, settings.storage_level);
+		compressed_image_hc = true;
 	} else {
 		allocateImage_nolock();
-		compressed = compressLZ4(image->data(), image->size());
+
+		// Re-compress only modified bands (or bands not compressed with the required quality)
+		auto *rgb = getRawImageBuffer(ChunkImage::band_size_bytes);
+		for(u32 band = 0; band < ChunkImage::band_count; band++) {
+			if(!stale_bands[band] && compressed_bands[band] && (compressed_bands_hc[band] || !for_storage))
+				continue;
+
+			image->storeBandRGB(band, rgb);
+			if(for_storage)
+				compressed_bands[band] = compressLZ4HC(rgb, ChunkImage::band_size_bytes, settings.storage_level);
+			else
+				compressed_bands[band] = compressLZ4(rgb, ChunkImage::band_size_bytes, settings.fast_acceleration);
+			compressed_bands_hc[band] = for_storage;
+			stale_bands[band] = false;
+		}
+
+		compressed = joinLZ4Blocks(compressed_bands, ChunkImage::band_count);
+		compressed_image_hc = compressed_bands_hc.all();
 	}
 
 	this->compressed_image = compressed;
@@ -83,30 +198,85 @@ SharedVector<u8> Chunk::encodeChunkData_nolock() {
 
 SharedVector<u8> Chunk::encodeChunkData(bool clear_modified) {
 	LockGuard lock(mtx_access);
-	auto compressed = encodeChunkData_nolock();
-	if(clear_modified) {
-		setModified_nolock(false);
-		image.reset();
 
-		auto *preview_system = chunk_system->room->getPreviewSystem();
+	if(!clear_modified || new_chunk || (compressed_image && compressed_image_hc))
+		return encodeChunkData_nolock(clear_modified);
+
+	auto level = chunk_system->room->settings.compression.storage_level;
+
+	// LZ4HC is slow, compress raw copies of stale bands without blocking writes to this chunk
+	allocateImage_nolock();
+	auto *rgb = getRawImageBuffer(getImageSizeBytes());
+	SharedVector<u8> bands[ChunkImage::band_count];
+	u32 generations[ChunkImage::band_count];
+	ChunkBandMask to_compress;
+	for(u32 band = 0; band < ChunkImage::band_count; band++) {
+		generations[band] = band_generations[band];
+		if(!stale_bands[band] && compressed_bands[band] && compressed_bands_hc[band]) {
+			bands[band] = compressed_bands[band];
+			continue;
+		}
 
-		Int2 upper_pos;
-		upper_pos.x = position.x >= 0 ? position.x / 2 : (position.x - 1) / 2;
-		upper_pos.y = position.y >= 0 ? position.y / 2 : (position.y - 1) / 2;
-		preview_system->addToQueueFront(upper_pos);
+		image->storeBandRGB(band, rgb + band * ChunkImage::band_size_bytes);
+		to_compress[band] = true;
+		stale_bands[band] = false;
 	}
+
+	auto saved_tiles = dirty_tiles;
+	dirty_tiles.reset();
+	setModified_nolock(false);
+	lock.free();
+
+	for(u32 band = 0; band < ChunkImage::band_count; band++) {
+		if(to_compress[band])
+			bands[band] = compressLZ4HC(rgb + band * ChunkImage::band_size_bytes, ChunkImage::band_size_bytes, level);
+	}
+
+	auto compressed = joinLZ4Blocks(bands, ChunkImage::band_count);
+
+	lock.setMutex(mtx_access);
+
+	// Keep compressed bands which weren't written in the meantime. stale_bands isn't enough,
+	// a fast encode (chunk image packet) could have cleared it again after a write.
+	for(u32 band = 0; band < ChunkImage::band_count; band++) {
+		if(to_compress[band] && generations[band] == band_generations[band]) {
+			compressed_bands[band] = bands[band];
+			compressed_bands_hc[band] = true;
+		}
+	}
+
+	// Saved tiles need their preview regenerated
+	auto *preview_system = chunk_system->room->getPreviewSystem();
+
+	Int2 upper_pos;
+	upper_pos.x = position.x >= 0 ? position.x / 2 : (position.x - 1) / 2;
+	upper_pos.y = position.y >= 0 ? position.y / 2 : (position.y - 1) / 2;
+	preview_system->addToQueueFront(upper_pos, PreviewSystem::maskToUpper(position, saved_tiles));
+
+	if(modified) {
+		// Modified while compressing, saved data is already outdated
+		return compressed;
+	}
+
+	// Image stays decompressed, the image cache of the chunk system decides when to drop it
+	compressed_image = compressed;
+	compressed_image_hc = true;
+
 	return compressed;
 }
 
-void Chunk::sendChunkDataToSession_nolock(Session *session) {
+Packet Chunk::getChunkImagePacket_nolock() {
+	if(packet_chunk_image)
+		return packet_chunk_image; // Shared by all sessions until the chunk is modified
+
 	SharedVector<u8> compressed_data;
 
 	if(compressed_image) {
 		// Grab from cache
 		compressed_data = compressed_image;
 	} else {
-		// Recompress chunk data
-		compressed_data = encodeChunkData_nolock();
+		// Recompress chunk data (fast codec, client is waiting for it)
+		compressed_data = encodeChunkData_nolock(false);
 	}
 
 	s32 chunk_x_BE = tobig32((s32)getPosition().x);
@@ -125,37 +295,43 @@ void Chunk::sendChunkDataToSession_nolock(Session *session) {
 			&data_compressed_data,
 			nullptr};
 
-	session->pushPacket(preparePacket(ServerCmd::chunk_image, datasizes));
+	packet_chunk_image = preparePacket(ServerCmd::chunk_image, datasizes);
+	return packet_chunk_image;
+}
+
+void Chunk::sendChunkDataToSession_nolock(Session *session) {
+	session->pushPacket(getChunkImagePacket_nolock());
 }
 
 void Chunk::linkSession(Session *session) {
 	LockGuard lock(mtx_access);
 
-	// Check if session pointer already exists
-	for(auto &cell : linked_sessions) {
-		if(cell == session)
-			return;
-	}
+	auto [it, inserted] = linked_session_index.try_emplace(session, (u32)linked_sessions.size());
+	if(!inserted)
+		return; // Already linked
 
 	linked_sessions_empty = false;
-
-	// Add session pointer
 	linked_sessions.push_back(session);
 
-	sendChunkDataToSession_nolock(session);
+	// Otherwise sent after loading finishes
+	if(!loading)
+		sendChunkDataToSession_nolock(session);
 }
 
 void Chunk::unlinkSession(Session *session) {
 	LockGuard lock(mtx_access);
 
-	// Find pointer
-	for(auto it = linked_sessions.begin(); it != linked_sessions.end();) {
-		if(*it == session) {
-			// Remove session pointer
-			it = linked_sessions.erase(it);
-			break;
-		} else {
-			it++;
+	auto it = linked_session_index.find(session);
+	if(it != linked_session_index.end()) {
+		// Swap with the last one, order doesn't matter
+		u32 index = it->second;
+		linked_session_index.erase(it);
+
+		auto *last = linked_sessions.back();
+		linked_sessions.pop_back();
+		if(last != session) {
+			linked_sessions[index] = last;
+			linked_session_index[last] = index;
 		}
 	}
 
@@ -171,6 +347,7 @@ bool Chunk::isLinkedSessionsEmpty() {
 }
 
 void Chunk::lock() {
+	waitUntilLoaded();
 	mtx_access.lock();
 }
 
@@ -179,8 +356,8 @@ void Chunk::unlock() {
 }
 
 void Chunk::setPixelsQueued_nolock(ChunkPixel *pixels, u32 count) {
-	allocateImage_nolock();
-	auto *rgb = image->data();
+	Buffer buf_changed; // Journaled
+	u32 changed_count = 0;
 
 	if(!send_chunk_data_instead_of_pixels) {
 		queued_pixels_to_send.reserve(queued_pixels_to_send.size() + count);
@@ -188,10 +365,12 @@ void Chunk::setPixelsQueued_nolock(ChunkPixel *pixels, u32 count) {
 
 	for(u32 i = 0; i < count; i++) {
 		auto &pixel = pixels[i];
-		size_t offset = pixel.pos.y * ChunkSystem::getChunkSize() * 3 + pixel.pos.x * 3;
-		rgb[offset + 0] = pixel.color.r;
-		rgb[offset + 1] = pixel.color.g;
-		rgb[offset + 2] = pixel.color.b;
+		if(writePixel_nolock(pixel.pos, pixel.color)) {
+			dirty_tiles_unsent[ChunkImage::getTileIndex(pixel.pos.x, pixel.pos.y)] = true;
+			u8 packed[5] = {(u8)pixel.pos.x, (u8)pixel.pos.y, pixel.color.r, pixel.color.g, pixel.color.b};
+			buf_changed.write(packed, sizeof(packed));
+			changed_count++;
+		}
 
 		if(!send_chunk_data_instead_of_pixels) {
 			queued_pixels_to_send.push_back(pixel);
@@ -201,7 +380,14 @@ void Chunk::setPixelsQueued_nolock(ChunkPixel *pixels, u32 count) {
 			}
 		}
 	}
-	setModified_nolock(true);
+
+	if(changed_count) {
+		setModified_nolock(true);
+		chunk_system->getJournal().appendPixels(position, buf_changed.data(), changed_count);
+	}
+
+	if(count && !in_flush_list.exchange(true))
+		chunk_system->addToFlushList(this);
 }
 
 void Chunk::setPixelQueued_nolock(ChunkPixel *pixel) {
@@ -209,6 +395,7 @@ void Chunk::setPixelQueued_nolock(ChunkPixel *pixel) {
 }
 
 void Chunk::setPixelQueued(ChunkPixel *pixel) {
+	waitUntilLoaded();
 	LockGuard lock(mtx_access);
 	setPixelQueued_nolock(pixel);
 }
@@ -220,47 +407,62 @@ void Chunk::flushQueuedPixels() {
 
 void Chunk::flushQueuedPixels_nolock() {
 	if(send_chunk_data_instead_of_pixels) {
-		for(auto &session : linked_sessions) {
-			sendChunkDataToSession_nolock(session);
+		if(dirty_tiles_unsent.count() <= ChunkImage::tile_count / 4) {
+			// Only a part of the chunk was modified, send pixels of modified tiles
+			auto *read_image = getImageForRead_nolock();
+			std::vector<ChunkPixel> pixels;
+			pixels.reserve(dirty_tiles_unsent.count() * ChunkTile::pixel_count);
+			for(u32 tile = 0; tile < ChunkImage::tile_count; tile++) {
+				if(!dirty_tiles_unsent[tile])
+					continue;
+
+				u32 start_x = (tile % ChunkImage::tiles_per_row) * ChunkTile::size;
+				u32 start_y = (tile / ChunkImage::tiles_per_row) * ChunkTile::size;
+				for(u32 y = start_y; y < start_y + ChunkTile::size; y++) {
+					for(u32 x = start_x; x < start_x + ChunkTile::size; x++) {
+						auto &pixel = pixels.emplace_back();
+						pixel.pos = {x, y};
+						read_image->getPixel(x, y, &pixel.color);
+					}
+				}
+			}
+			setPixels_nolock(pixels.data(), pixels.size(), true);
+		} else {
+			// Every session gets the same packet, encoded once
+			for(auto &session : linked_sessions) {
+				sendChunkDataToSession_nolock(session);
+			}
 		}
 		send_chunk_data_instead_of_pixels = false;
 	} else {
-		if(queued_pixels_to_send.empty()) return;
-		setPixels_nolock(queued_pixels_to_send.data(), queued_pixels_to_send.size(), true);
+		if(!queued_pixels_to_send.empty())
+			setPixels_nolock(queued_pixels_to_send.data(), queued_pixels_to_send.size(), true);
 		queued_pixels_to_send.clear();
 	}
+	dirty_tiles_unsent.reset();
 }
 
 void Chunk::setPixels(ChunkPixel *pixels, size_t count) {
+	waitUntilLoaded();
 	LockGuard lock(mtx_access);
 	flushQueuedPixels_nolock();
 	setPixels_nolock(pixels, count);
 }
 
 void Chunk::setPixels_nolock(ChunkPixel *pixels, size_t count, bool only_send) {
-	allocateImage_nolock();
-
 	// Prepare pixel_pack packet
 	Buffer buf_pixels;
 	u32 pixel_count = 0;
 
-	Color color;
 	for(size_t i = 0; i < count; i++) {
 		auto &pixel = pixels[i];
 
 		if(!only_send) {
-			getPixel_nolock(pixel.pos, &color);
-			if(pixel.color == color) {
+			// Update pixel
+			if(!writePixel_nolock(pixel.pos, pixel.color)) {
 				// Pixel not changed, skip
 				continue;
 			}
-
-			// Update pixel
-			auto *rgb = image->data();
-			size_t offset = pixel.pos.y * ChunkSystem::getChunkSize() * 3 + pixel.pos.x * 3;
-			rgb[offset + 0] = pixel.color.r;
-			rgb[offset + 1] = pixel.color.g;
-			rgb[offset + 2] = pixel.color.b;
 		}
 
 		// Prepare pixel data
@@ -278,7 +480,7 @@ void Chunk::setPixels_nolock(ChunkPixel *pixels, size_t count, bool only_send) {
 	if(pixel_count == 0)
 		return; // Nothing modified
 
-	auto compressed = compressLZ4(buf_pixels.data(), buf_pixels.size());
+	auto compressed = compressLZ4(buf_pixels.data(), buf_pixels.size(), chunk_system->room->settings.compression.fast_acceleration);
 
 	s32 chunk_x_BE = tobig32((s32)getPosition().x);
 	s32 chunk_y_BE = tobig32((s32)getPosition().y);
@@ -305,7 +507,126 @@ void Chunk::setPixels_nolock(ChunkPixel *pixels, size_t count, bool only_send) {
 		session->pushPacket(packet);
 	}
 
+	if(!only_send) {
+		setModified_nolock(true);
+		// After setting modified flag, so the autosave checkpoint covering this record also saves this chunk
+		chunk_system->getJournal().appendPixels(position, buf_pixels.data(), pixel_count);
+	}
+}
+
+void Chunk::setRect(UInt2 pos, u32 width, u32 height, const u8 *rgb, u32 pitch) {
+	waitUntilLoaded();
+	LockGuard lock(mtx_access);
+	flushQueuedPixels_nolock();
+	setRect_nolock(pos, width, height, rgb, pitch);
+}
+
+void Chunk::setPixelsCompact_nolock(ChunkPixel *pixels, u32 count) {
+	if(count == 0)
+		return;
+
+	// Pixels queued earlier must not reach clients after these
+	flushQueuedPixels_nolock();
+
+	UInt2 start = pixels[0].pos;
+	UInt2 end = pixels[0].pos;
+	for(u32 i = 1; i < count; i++) {
+		start.x = std::min(start.x, pixels[i].pos.x);
+		start.y = std::min(start.y, pixels[i].pos.y);
+		end.x = std::max(end.x, pixels[i].pos.x);
+		end.y = std::max(end.y, pixels[i].pos.y);
+	}
+
+	// pixel_pack takes 5 bytes per pixel, rect_pack 3 bytes per pixel of the whole rectangle
+	u32 width = end.x - start.x + 1;
+	u32 height = end.y - start.y + 1;
+	if(width * height * 3 > count * 5) {
+		setPixels_nolock(pixels, count);
+		return;
+	}
+
+	// Dense, current rectangle with pixels applied
+	u32 pitch = width * 3;
+	std::vector<u8> rgb(height * pitch);
+	auto *read_image = getImageForRead_nolock();
+	for(u32 y = 0; y < height; y++) {
+		for(u32 x = 0; x < width; x++) {
+			Color color;
+			read_image->getPixel(start.x + x, start.y + y, &color);
+			auto *out = rgb.data() + y * pitch + x * 3;
+			out[0] = color.r;
+			out[1] = color.g;
+			out[2] = color.b;
+		}
+	}
+
+	for(u32 i = 0; i < count; i++) {
+		auto *out = rgb.data() + (pixels[i].pos.y - start.y) * pitch + (pixels[i].pos.x - start.x) * 3;
+		out[0] = pixels[i].color.r;
+		out[1] = pixels[i].color.g;
+		out[2] = pixels[i].color.b;
+	}
+
+	setRect_nolock(start, width, height, rgb.data(), pitch);
+}
+
+void Chunk::setRect_nolock(UInt2 pos, u32 width, u32 height, const u8 *rgb, u32 pitch) {
+	assert(pos.x + width <= ChunkSystem::getChunkSize());
+	assert(pos.y + height <= ChunkSystem::getChunkSize());
+
+	if(width == 0 || height == 0)
+		return;
+
+	if(!image && new_chunk) {
+		// Copy-on-write, writing white pixels to a blank chunk changes nothing
+		bool blank = true;
+		for(u32 y = 0; y < height && blank; y++)
+			blank = rgbIsUniform(rgb + y * pitch, width, Color(255, 255, 255));
+		if(blank)
+			return;
+	}
+
+	auto changed = acquireImage_nolock()->setRect(pos.x, pos.y, width, height, rgb, pitch);
+	if(changed.none())
+		return; // Nothing modified
+
+	markTilesModified_nolock(changed);
+
+	// Prepare rect_pack packet, rows are sent contiguously
+	const u8 *rect_rgb = rgb;
+	if(pitch != width * 3) {
+		auto *buf = getRawImageBuffer(width * height * 3);
+		for(u32 y = 0; y < height; y++)
+			memcpy(buf + y * width * 3, rgb + y * pitch, width * 3);
+		rect_rgb = buf;
+	}
+
+	auto compressed = compressLZ4(rect_rgb, width * height * 3, chunk_system->room->settings.compression.fast_acceleration);
+
+	s32 chunk_x_BE = tobig32((s32)getPosition().x);
+	s32 chunk_y_BE = tobig32((s32)getPosition().y);
+	u16 rect_BE[4] = {tobig16((u16)pos.x), tobig16((u16)pos.y), tobig16((u16)width), tobig16((u16)height)};
+
+	Datasize data_chunk_x(&chunk_x_BE, sizeof(s32));
+	Datasize data_chunk_y(&chunk_y_BE, sizeof(s32));
+	Datasize data_rect(rect_BE, sizeof(rect_BE));
+	Datasize data_compressed_data(compressed->data(), compressed->size());
+
+	Datasize *datasizes[] = {
+			&data_chunk_x,
+			&data_chunk_y,
+			&data_rect,
+			&data_compressed_data,
+			nullptr};
+
+	auto packet = preparePacket(ServerCmd::chunk_rect_pack, datasizes);
+
+	for(auto &session : linked_sessions) {
+		session->pushPacket(packet);
+	}
+
 	setModified_nolock(true);
+	chunk_system->getJournal().appendRect(position, pos, width, height, compressed->data(), compressed->size());
 }
 
 Int2 Chunk::getPosition() const {
@@ -316,10 +637,53 @@ bool Chunk::isModified() {
 	return modified;
 }
 
+u32 Chunk::getDirtyTileCount() {
+	LockGuard lock(mtx_access);
+	return dirty_tiles.count();
+}
+
+void Chunk::markTilesModified_nolock(const ChunkTileMask &tiles) {
+	new_chunk = false;
+	dirty_tiles |= tiles;
+	const ChunkTileMask band_mask((1u << ChunkImage::tiles_per_row) - 1);
+	for(u32 band = 0; band < ChunkImage::band_count; band++) {
+		if(((tiles >> (band * ChunkImage::tiles_per_row)) & band_mask).any()) {
+			stale_bands[band] = true;
+			band_generations[band]++;
+		}
+	}
+}
+
+void Chunk::markModified_nolock(UInt2 chunk_pixel_pos) {
+	new_chunk = false;
+	dirty_tiles[ChunkImage::getTileIndex(chunk_pixel_pos.x, chunk_pixel_pos.y)] = true;
+	u32 band = chunk_pixel_pos.y / ChunkTile::size;
+	stale_bands[band] = true;
+	band_generations[band]++;
+}
+
+size_t Chunk::getMemoryUsage() {
+	LockGuard lock(mtx_access);
+	size_t total = sizeof(Chunk);
+	if(image)
+		total += image->getMemoryUsage();
+	if(compressed_image)
+		total += compressed_image->capacity();
+	for(auto &band : compressed_bands) {
+		if(band)
+			total += band->capacity();
+	}
+	total += queued_pixels_to_send.capacity() * sizeof(ChunkPixel);
+	total += linked_sessions.capacity() * sizeof(Session *);
+	total += linked_session_index.size() * (sizeof(Session *) + sizeof(u32));
+	return total;
+}
+
 void Chunk::setModified_nolock(bool n) {
 	modified = n;
 	if(modified) {
 		// Compressed image data is now invalid
 		compressed_image.reset();
+		packet_chunk_image.reset();
 	}
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "chunk_image.hpp"
 #include "color.hpp"
 #include "server.hpp"
 #include "util/smartptr.hpp"
@@ -8,6 +9,7 @@
 #include <memory>
 #include <mutex>
 #include <stack>
+#include <unordered_map>
 #include <vector>
 
 struct ChunkSystem;
@@ -22,7 +24,8 @@ struct Chunk {
 	u32 getImageSizeBytes() const;
 
 private:
-	bool new_chunk = true; // Newly (and blank) chunk?
+	bool new_chunk = true; // Blank chunk, never written (image not allocated on read)
+	std::atomic<bool> loading = true; // Placeholder, data is being loaded from the database by the chunk loader
 	ChunkSystem *chunk_system;
 	Int2 position;
 
@@ -31,39 +34,100 @@ private:
 
 	std::vector<ChunkPixel> queued_pixels_to_send;
 
+	// Intrusive link of the chunk system flush list (chunks with queued pixels)
+	std::atomic<bool> in_flush_list = false;
+	Chunk *next_in_flush_list = nullptr;
+
+	// Room jobs using this chunk, pinned chunks are not garbage collected
+	std::atomic<u32> pin_count = 0;
+
 	Mutex mtx_access;
 
-	SharedVector<u8> image;
+	uniqptr<ChunkImage> image;
+	// Chunk system tick of the last image access (LRU order)
+	u32 image_last_access = 0;
+	// Image cache statistics, collected by the chunk system
+	u32 image_cache_hits = 0;
+	u32 image_cache_misses = 0;
 	SharedVector<u8> compressed_image;
+	bool compressed_image_hc = false; // compressed_image was compressed with LZ4HC (storage quality)
+
+	// Separately compressed bands (rows of tiles), joined into compressed_image.
+	// Only stale bands are compressed again.
+	SharedVector<u8> compressed_bands[ChunkImage::band_count];
+	ChunkBandMask compressed_bands_hc;
+	ChunkBandMask stale_bands;
+	// Incremented by pixel writes only, tells whether a band changed while it was compressed unlocked
+	u32 band_generations[ChunkImage::band_count] = {};
+
+	// Tiles modified since last save (used by preview system)
+	ChunkTileMask dirty_tiles;
+	// Tiles modified by queued pixels since last flush
+	ChunkTileMask dirty_tiles_unsent;
+
+	// Prebuilt chunk_image packet of the current chunk version, shared by all linked sessions
+	Packet packet_chunk_image;
 
 	bool send_chunk_data_instead_of_pixels = false;
 
 	std::atomic<bool> linked_sessions_empty = true;
-	std::vector<Session *> linked_sessions;
+	std::vector<Session *> linked_sessions;								 // Dense, iterated on every broadcast
+	std::unordered_map<Session *, u32> linked_session_index; // Index into linked_sessions
 
+	Packet getChunkImagePacket_nolock();
 	void sendChunkDataToSession_nolock(Session *session);
-	SharedVector<u8> encodeChunkData_nolock();
+	/// @param for_storage Use slow LZ4HC compression instead of fast LZ4
+	SharedVector<u8> encodeChunkData_nolock(bool for_storage);
 	void setModified_nolock(bool n);
+	void markModified_nolock(UInt2 chunk_pixel_pos);
+	void markTilesModified_nolock(const ChunkTileMask &tiles);
+
+	void allocateImage_nolock();
+	/// @returns image, decompressed if needed. Counts cache hits/misses and updates LRU order
+	ChunkImage *acquireImage_nolock();
+	/// @brief Frees decompressed image if it can be restored from compressed data
+	/// @returns true if freed
+	bool evictImage_nolock();
+	/// @returns image, or shared blank image if this chunk was never written
+	const ChunkImage *getImageForRead_nolock();
+	/// @returns true if pixel color was changed. Allocates image on the first change only
+	bool writePixel_nolock(UInt2 chunk_pixel_pos, Color color);
 
 public:
-	Chunk(ChunkSystem *chunk_system, Int2 position, SharedVector<u8> compressed_chunk_data);
+	// Creates loading placeholder, finishLoading() has to be called with database data
+	Chunk(ChunkSystem *chunk_system, Int2 position);
 	~Chunk();
 
+	void finishLoading(SharedVector<u8> compressed_chunk_data);
+	bool isLoading() const;
+	// Blocks calling thread only, no locks have to be held
+	void waitUntilLoaded();
+
 	friend struct ChunkSystem;
 
 	void linkSession(Session *session);
 	void unlinkSession(Session *session);
 	bool isLinkedSessionsEmpty();
 
-	void allocateImage_nolock();
-
-	/// @param clear_modified Set to true if encoded chunk data will be used to save, raw RGB data will be freed
+	/// @param clear_modified Set to true if encoded chunk data will be used to save, raw RGB data will be freed.
+	/// Saved data is compressed with LZ4HC outside of the chunk lock
 	SharedVector<u8> encodeChunkData(bool clear_modified);
 	bool isModified();
+	u32 getDirtyTileCount();
+
+	/// @returns memory used by this chunk (image tiles, compressed data and queued pixels)
+	size_t getMemoryUsage();
 
 	void setPixels(ChunkPixel *pixels, size_t count);
 	void setPixels_nolock(ChunkPixel *pixels, size_t count, bool only_send = false);
 
+	/// @brief Writes RGB rectangle (pitch in bytes) and sends it to linked sessions as a single rect_pack
+	void setRect(UInt2 pos, u32 width, u32 height, const u8 *rgb, u32 pitch);
+	void setRect_nolock(UInt2 pos, u32 width, u32 height, const u8 *rgb, u32 pitch);
+
+	/// @brief Writes scattered pixels as a pixel_pack, or as their bounding rectangle (other pixels unchanged) if they cover most of it
+	void setPixelsCompact_nolock(ChunkPixel *pixels, u32 count);
+
 	// Set pixel and send it later (delayed send)
 	void setPixelQueued(ChunkPixel *pixel);
 	void setPixelsQueued_nolock(ChunkPixel *pixels, u32 count);
@@ -75,7 +139,12 @@ public:
 	Int2 getPosition() const;
 
 	void getPixel_nolock(UInt2 chunk_pixel_pos, Color *color);
+	// Reads colors of multiple pixels (positions only, colors of input pixels are ignored)
+	void getPixels_nolock(const ChunkPixel *pixels, u32 count, Color *colors);
+	// Stores whole image as raw RGB (getImageSizeBytes() bytes)
+	void getRGB_nolock(u8 *rgb);
 
+	// Waits until loaded
 	void lock();
 	void unlock();
 };
@@ -0,0 +1,361 @@
+#include "chunk_image.hpp"
+#include "util/pixel_kernels.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+static constexpr u32 palette_bytes = ChunkTile::palette_max_colors * 3;
+static constexpr u32 indices_bytes = ChunkTile::pixel_count / 2;
+static constexpr u32 rgb_bytes = ChunkTile::pixel_count * 3;
+
+u8 *ChunkTile::getPalette() const {
+	return data.ptr;
+}
+
+u8 *ChunkTile::getIndices() const {
+	return data.ptr + palette_bytes;
+}
+
+void ChunkTile::getPixel(u32 x, u32 y, Color *out) const {
+	switch(type) {
+		case Type::uniform: {
+			*out = color;
+			break;
+		}
+		case Type::palette: {
+			u32 index = y * size + x;
+			u8 pair = getIndices()[index / 2];
+			u8 color_index = (index & 1) ? (pair >> 4) : (pair & 0x0F);
+			auto *rgb = getPalette() + color_index * 3;
+			*out = Color(rgb[0], rgb[1], rgb[2]);
+			break;
+		}
+		case Type::rgb: {
+			auto *rgb = data.ptr + (y * size + x) * 3;
+			*out = Color(rgb[0], rgb[1], rgb[2]);
+			break;
+		}
+	}
+}
+
+bool ChunkTile::setPixel(u32 x, u32 y, Color new_color) {
+	switch(type) {
+		case Type::uniform: {
+			if(color == new_color)
+				return false;
+
+			convertToPalette(color, new_color);
+			// Every index points to the previous color, palette[1] is the new one
+			u32 index = y * size + x;
+			auto &pair = getIndices()[index / 2];
+			pair = (index & 1) ? ((pair & 0x0F) | 0x10) : ((pair & 0xF0) | 0x01);
+			return true;
+		}
+		case Type::palette: {
+			u32 index = y * size + x;
+			auto &pair = getIndices()[index / 2];
+			u8 current_index = (index & 1) ? (pair >> 4) : (pair & 0x0F);
+
+			auto *palette = getPalette();
+			auto *current = palette + current_index * 3;
+			if(current[0] == new_color.r && current[1] == new_color.g && current[2] == new_color.b)
+				return false;
+
+			// Find color in palette
+			u8 color_index = palette_size;
+			for(u8 i = 0; i < palette_size; i++) {
+				auto *rgb = palette + i * 3;
+				if(rgb[0] == new_color.r && rgb[1] == new_color.g && rgb[2] == new_color.b) {
+					color_index = i;
+					break;
+				}
+			}
+
+			if(color_index == palette_size) {
+				if(palette_size == palette_max_colors) {
+					// Palette full, fall back to raw RGB
+					convertToRGB();
+					return setPixel(x, y, new_color);
+				}
+
+				auto *rgb = palette + palette_size * 3;
+				rgb[0] = new_color.r;
+				rgb[1] = new_color.g;
+				rgb[2] = new_color.b;
+				palette_size++;
+			}
+
+			pair = (index & 1) ? ((pair & 0x0F) | (color_index << 4)) : ((pair & 0xF0) | color_index);
+			return true;
+		}
+		case Type::rgb: {
+			auto *rgb = data.ptr + (y * size + x) * 3;
+			if(rgb[0] == new_color.r && rgb[1] == new_color.g && rgb[2] == new_color.b)
+				return false;
+
+			rgb[0] = new_color.r;
+			rgb[1] = new_color.g;
+			rgb[2] = new_color.b;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ChunkTile::fill(Color new_color) {
+	data.reset();
+	type = Type::uniform;
+	palette_size = 0;
+	color = new_color;
+}
+
+void ChunkTile::convertToPalette(Color first, Color second) {
+	assert(type == Type::uniform);
+	data.create(palette_bytes + indices_bytes);
+
+	auto *palette = getPalette();
+	palette[0] = first.r;
+	palette[1] = first.g;
+	palette[2] = first.b;
+	palette[3] = second.r;
+	palette[4] = second.g;
+	palette[5] = second.b;
+	palette_size = 2;
+
+	memset(getIndices(), 0, indices_bytes);
+	type = Type::palette;
+}
+
+void ChunkTile::convertToRGB() {
+	uniqdata<u8> rgb(rgb_bytes);
+	store(rgb.data(), size * 3);
+	rgb.move_to(&data);
+	type = Type::rgb;
+	palette_size = 0;
+}
+
+void ChunkTile::load(const u8 *rgb, u32 pitch) {
+	Color colors[palette_max_colors];
+	u32 color_count = 0;
+
+	// Count unique colors (up to palette size)
+	for(u32 y = 0; y < size && color_count <= palette_max_colors; y++) {
+		auto *row = rgb + y * pitch;
+		for(u32 x = 0; x < size; x++) {
+			Color c(row[x * 3 + 0], row[x * 3 + 1], row[x * 3 + 2]);
+			u32 i = 0;
+			for(; i < color_count; i++) {
+				if(colors[i] == c)
+					break;
+			}
+
+			if(i == color_count) {
+				if(color_count == palette_max_colors) {
+					color_count++; // Too many colors
+					break;
+				}
+				colors[color_count++] = c;
+			}
+		}
+	}
+
+	if(color_count == 1) {
+		fill(colors[0]);
+		return;
+	}
+
+	if(color_count <= palette_max_colors) {
+		if(type != Type::palette)
+			data.create(palette_bytes + indices_bytes);
+		type = Type::palette;
+		palette_size = color_count;
+
+		auto *palette = getPalette();
+		for(u32 i = 0; i < color_count; i++) {
+			palette[i * 3 + 0] = colors[i].r;
+			palette[i * 3 + 1] = colors[i].g;
+			palette[i * 3 + 2] = colors[i].b;
+		}
+
+		auto *indices = getIndices();
+		memset(indices, 0, indices_bytes);
+		for(u32 y = 0; y < size; y++) {
+			auto *row = rgb + y * pitch;
+			for(u32 x = 0; x < size; x++) {
+				Color c(row[x * 3 + 0], row[x * 3 + 1], row[x * 3 + 2]);
+				u8 color_index = 0;
+				while(!(colors[color_index] == c))
+					color_index++;
+
+				u32 index = y * size + x;
+				indices[index / 2] |= (index & 1) ? (color_index << 4) : color_index;
+			}
+		}
+		return;
+	}
+
+	if(type != Type::rgb)
+		data.create(rgb_bytes);
+	type = Type::rgb;
+	palette_size = 0;
+	for(u32 y = 0; y < size; y++)
+		memcpy(data.ptr + y * size * 3, rgb + y * pitch, size * 3);
+}
+
+void ChunkTile::store(u8 *rgb, u32 pitch) const {
+	switch(type) {
+		case Type::uniform: {
+			for(u32 y = 0; y < size; y++)
+				rgbFill(rgb + y * pitch, size, color);
+			break;
+		}
+		case Type::palette: {
+			auto *palette = getPalette();
+			auto *indices = getIndices();
+			for(u32 y = 0; y < size; y++) {
+				auto *row = rgb + y * pitch;
+				for(u32 x = 0; x < size; x++) {
+					u32 index = y * size + x;
+					u8 pair = indices[index / 2];
+					u8 color_index = (index & 1) ? (pair >> 4) : (pair & 0x0F);
+					memcpy(row + x * 3, palette + color_index * 3, 3);
+				}
+			}
+			break;
+		}
+		case Type::rgb: {
+			for(u32 y = 0; y < size; y++)
+				memcpy(rgb + y * pitch, data.ptr + y * size * 3, size * 3);
+			break;
+		}
+	}
+}
+
+bool ChunkTile::replace(const u8 *rgb, u32 pitch) {
+	u8 current[rgb_bytes];
+	store(current, size * 3);
+
+	bool changed = false;
+	for(u32 y = 0; y < size && !changed; y++)
+		changed = memcmp(current + y * size * 3, rgb + y * pitch, size * 3) != 0;
+
+	if(changed)
+		load(rgb, pitch);
+	return changed;
+}
+
+u32 ChunkTile::getMemoryUsage() const {
+	switch(type) {
+		case Type::uniform: return 0;
+		case Type::palette: return palette_bytes + indices_bytes;
+		case Type::rgb: return rgb_bytes;
+	}
+	return 0;
+}
+
+void ChunkTile::copyFrom(const ChunkTile &other) {
+	type = other.type;
+	palette_size = other.palette_size;
+	color = other.color;
+
+	auto bytes = other.getMemoryUsage();
+	if(bytes) {
+		data.create(bytes);
+		memcpy(data.ptr, other.data.ptr, bytes);
+	} else {
+		data.reset();
+	}
+}
+
+ChunkImage::ChunkImage() {
+}
+
+void ChunkImage::fill(Color color) {
+	for(auto &tile : tiles)
+		tile.fill(color);
+}
+
+ChunkTileMask ChunkImage::setRect(u32 x, u32 y, u32 width, u32 height, const u8 *rgb, u32 pitch) {
+	assert(x + width <= size && y + height <= size);
+
+	ChunkTileMask changed;
+	if(width == 0 || height == 0)
+		return changed;
+
+	for(u32 ty = y / ChunkTile::size; ty <= (y + height - 1) / ChunkTile::size; ty++) {
+		for(u32 tx = x / ChunkTile::size; tx <= (x + width - 1) / ChunkTile::size; tx++) {
+			// Part of the rectangle inside this tile
+			u32 left = std::max(x, tx * ChunkTile::size);
+			u32 top = std::max(y, ty * ChunkTile::size);
+			u32 right = std::min(x + width, (tx + 1) * ChunkTile::size);
+			u32 bottom = std::min(y + height, (ty + 1) * ChunkTile::size);
+
+			u32 index = ty * tiles_per_row + tx;
+			auto &tile = tiles[index];
+			auto *origin = rgb + (top - y) * pitch + (left - x) * 3;
+
+			if(right - left == ChunkTile::size && bottom - top == ChunkTile::size) {
+				changed[index] = tile.replace(origin, pitch);
+				continue;
+			}
+
+			// Partially covered tile, compare rows with current contents and write changed pixels only
+			u8 current[ChunkTile::pixel_count * 3];
+			tile.store(current, ChunkTile::size * 3);
+
+			u32 tile_x = left % ChunkTile::size;
+			bool tile_changed = false;
+			for(u32 py = top; py < bottom; py++) {
+				u32 tile_y = py % ChunkTile::size;
+				auto *row = origin + (py - top) * pitch;
+				u64 mask;
+				if(!rgbDiffMask(current + (tile_y * ChunkTile::size + tile_x) * 3, row, right - left, &mask))
+					continue;
+
+				while(mask) {
+					u32 i = __builtin_ctzll(mask);
+					mask &= mask - 1;
+					auto *src = row + i * 3;
+					tile.setPixel(tile_x + i, tile_y, Color(src[0], src[1], src[2]));
+				}
+				tile_changed = true;
+			}
+			changed[index] = tile_changed;
+		}
+	}
+
+	return changed;
+}
+
+void ChunkImage::loadRGB(const u8 *rgb) {
+	const u32 pitch = size * 3;
+	for(u32 ty = 0; ty < tiles_per_row; ty++) {
+		for(u32 tx = 0; tx < tiles_per_row; tx++) {
+			auto *origin = rgb + ty * ChunkTile::size * pitch + tx * ChunkTile::size * 3;
+			tiles[ty * tiles_per_row + tx].load(origin, pitch);
+		}
+	}
+}
+
+void ChunkImage::storeRGB(u8 *rgb) const {
+	for(u32 band = 0; band < band_count; band++)
+		storeBandRGB(band, rgb + band * band_size_bytes);
+}
+
+void ChunkImage::storeBandRGB(u32 band, u8 *rgb) const {
+	const u32 pitch = size * 3;
+	for(u32 tx = 0; tx < tiles_per_row; tx++)
+		tiles[band * tiles_per_row + tx].store(rgb + tx * ChunkTile::size * 3, pitch);
+}
+
+size_t ChunkImage::getMemoryUsage() const {
+	size_t total = sizeof(ChunkImage);
+	for(auto &tile : tiles)
+		total += tile.getMemoryUsage();
+	return total;
+}
+
+void ChunkImage::copyFrom(const ChunkImage &other) {
+	for(u32 i = 0; i < tile_count; i++)
+		tiles[i].copyFrom(other.tiles[i]);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "color.hpp"
+#include "util/smartptr.hpp"
+#include "util/types.hpp"
+#include <bitset>
+
+// Square block of chunk pixels, stored in the smallest representation able to hold its contents
+struct ChunkTile {
+	static constexpr u32 size = 16; // Width and height in pixels
+	static constexpr u32 pixel_count = size * size;
+	static constexpr u32 palette_max_colors = 16;
+
+	enum struct Type : u8 {
+		uniform = 0, // Single color, no pixel data allocated
+		palette = 1, // Up to 16 colors, 4 bits per pixel
+		rgb = 2			 // Raw RGB pixels
+	};
+
+	Type type = Type::uniform;
+	u8 palette_size = 0;
+	Color color = {255, 255, 255}; // Used by uniform tiles only
+
+	// Palette tiles: palette colors (RGB) followed by 4-bit indices
+	// RGB tiles: raw RGB pixels
+	uniqdata<u8> data;
+
+	void getPixel(u32 x, u32 y, Color *out) const;
+
+	///@returns true if pixel color was changed
+	bool setPixel(u32 x, u32 y, Color new_color);
+
+	void fill(Color new_color);
+
+	/// Rebuilds tile from RGB data, picks the smallest representation
+	void load(const u8 *rgb, u32 pitch);
+	void store(u8 *rgb, u32 pitch) const;
+
+	/// Replaces whole tile with RGB data
+	///@returns true if tile contents were changed
+	bool replace(const u8 *rgb, u32 pitch);
+
+	// Heap memory used by pixel data
+	u32 getMemoryUsage() const;
+
+	void copyFrom(const ChunkTile &other);
+
+private:
+	u8 *getPalette() const;
+	u8 *getIndices() const;
+	void convertToRGB();
+	void convertToPalette(Color first, Color second);
+};
+
+// One bit per tile, index = ChunkImage::getTileIndex()
+typedef std::bitset<256> ChunkTileMask;
+// One bit per band (row of tiles)
+typedef std::bitset<16> ChunkBandMask;
+
+// RGB image of a single chunk, divided into tiles
+struct ChunkImage {
+	static constexpr u32 size = 256; // Width and height in pixels
+	static constexpr u32 tiles_per_row = size / ChunkTile::size;
+	static constexpr u32 tile_count = tiles_per_row * tiles_per_row;
+
+	// Band = one row of tiles, contiguous in raw RGB layout
+	static constexpr u32 band_count = tiles_per_row;
+	static constexpr u32 band_size_bytes = size * ChunkTile::size * 3;
+
+	inline static u32 getTileIndex(u32 x, u32 y) {
+		return (y / ChunkTile::size) * tiles_per_row + x / ChunkTile::size;
+	}
+
+	ChunkImage();
+	ChunkImage(const ChunkImage &) = delete;
+
+	inline const ChunkTile &getTile(u32 x, u32 y) const {
+		return tiles[getTileIndex(x, y)];
+	}
+
+	inline ChunkTile &getTile(u32 x, u32 y) {
+		return tiles[getTileIndex(x, y)];
+	}
+
+	inline void getPixel(u32 x, u32 y, Color *color) const {
+		getTile(x, y).getPixel(x % ChunkTile::size, y % ChunkTile::size, color);
+	}
+
+	///@returns true if pixel color was changed
+	inline bool setPixel(u32 x, u32 y, Color color) {
+		return getTile(x, y).setPixel(x % ChunkTile::size, y % ChunkTile::size, color);
+	}
+
+	void fill(Color color);
+
+	/// Writes RGB rectangle (width * height pixels, pitch in bytes). Fully covered tiles are replaced at once.
+	///@returns tiles whose contents were changed
+	ChunkTileMask setRect(u32 x, u32 y, u32 width, u32 height, const u8 *rgb, u32 pitch);
+
+	/// Load raw RGB image (size * size * 3 bytes)
+	void loadRGB(const u8 *rgb);
+
+	/// Store raw RGB image (size * size * 3 bytes)
+	void storeRGB(u8 *rgb) const;
+
+	/// Store raw RGB rows of a single band (band_size_bytes)
+	void storeBandRGB(u32 band, u8 *rgb) const;
+
+	/// Total memory used by this image, including tile headers
+	size_t getMemoryUsage() const;
+
+	void copyFrom(const ChunkImage &other);
+
+private:
+	ChunkTile tiles[tile_count];
+};
+
+static_assert(ChunkImage::tile_count == ChunkTileMask().size());
+static_assert(ChunkImage::band_count == ChunkBandMask().size());
+
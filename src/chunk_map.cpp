@@ -0,0 +1,125 @@
+#include "chunk_map.hpp"
+#include "chunk.hpp"
+#include <cassert>
+
+// Grow when more than 3/4 of slots are used
+static bool isOverloaded(u32 used, u32 capacity) {
+	return capacity == 0 || (used + 1) * 4 > capacity * 3;
+}
+
+u64 ChunkMap::hashKey(u64 key) {
+	// splitmix64 finalizer, neighbouring chunks land in different shards and slots
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ull;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebull;
+	key ^= key >> 31;
+	return key;
+}
+
+ChunkMapShard &ChunkMap::getShard(Int2 chunk_pos) {
+	// High bits select the shard, low bits select the slot
+	return shards[hashKey(packKey(chunk_pos)) >> 60];
+}
+
+static_assert(ChunkMap::shard_count == 16, "getShard() uses 4 high bits of the hash");
+
+std::vector<Chunk *> ChunkMap::collect() {
+	std::vector<Chunk *> out;
+	forEach([&](Chunk *chunk) {
+		out.push_back(chunk);
+	});
+	return out;
+}
+
+u32 ChunkMap::size() {
+	u32 total = 0;
+	for(auto &shard : shards) {
+		LockGuard lock(shard.mtx);
+		total += shard.size_nolock();
+	}
+	return total;
+}
+
+Chunk *ChunkMapShard::find_nolock(Int2 chunk_pos) const {
+	if(slots.empty())
+		return nullptr;
+
+	auto key = ChunkMap::packKey(chunk_pos);
+	u32 mask = slots.size() - 1;
+	for(u32 i = ChunkMap::hashKey(key) & mask;; i = (i + 1) & mask) {
+		auto &slot = slots[i];
+		if(!slot.chunk)
+			return nullptr;
+		if(slot.key == key)
+			return slot.chunk.get();
+	}
+}
+
+Chunk *ChunkMapShard::insert_nolock(Int2 chunk_pos, uniqptr<Chunk> &&chunk) {
+	assert(!find_nolock(chunk_pos));
+
+	if(isOverloaded(used, slots.size()))
+		rehash_nolock(slots.empty() ? 64 : slots.size() * 2);
+
+	auto key = ChunkMap::packKey(chunk_pos);
+	u32 mask = slots.size() - 1;
+	u32 i = ChunkMap::hashKey(key) & mask;
+	while(slots[i].chunk)
+		i = (i + 1) & mask;
+
+	slots[i].key = key;
+	slots[i].chunk = std::move(chunk);
+	used++;
+	return slots[i].chunk.get();
+}
+
+bool ChunkMapShard::erase_nolock(Int2 chunk_pos) {
+	if(slots.empty())
+		return false;
+
+	auto key = ChunkMap::packKey(chunk_pos);
+	u32 mask = slots.size() - 1;
+	u32 i = ChunkMap::hashKey(key) & mask;
+	while(true) {
+		if(!slots[i].chunk)
+			return false;
+		if(slots[i].key == key)
+			break;
+		i = (i + 1) & mask;
+	}
+
+	slots[i].chunk.reset();
+	used--;
+
+	// Backward shift deletion, keeps probe sequences intact without tombstones
+	for(u32 j = (i + 1) & mask; slots[j].chunk; j = (j + 1) & mask) {
+		u32 home = ChunkMap::hashKey(slots[j].key) & mask;
+		// Move entry into the hole if its home slot is not between the hole and its current position
+		if(((j - home) & mask) >= ((j - i) & mask)) {
+			slots[i].key = slots[j].key;
+			slots[i].chunk = std::move(slots[j].chunk);
+			i = j;
+		}
+	}
+
+	return true;
+}
+
+void ChunkMapShard::rehash_nolock(u32 new_capacity) {
+	std::vector<Slot> old_slots(new_capacity);
+	old_slots.swap(slots);
+
+	u32 mask = new_capacity - 1;
+	for(auto &old : old_slots) {
+		if(!old.chunk)
+			continue;
+
+		u32 i = ChunkMap::hashKey(old.key) & mask;
+		while(slots[i].chunk)
+			i = (i + 1) & mask;
+
+		slots[i].key = old.key;
+		slots[i].chunk = std::move(old.chunk);
+	}
+}
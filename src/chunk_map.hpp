@@ -0,0 +1,79 @@
+#pragma once
+
+#include "util/mutex.hpp"
+#include "util/smartptr.hpp"
+#include "util/types.hpp"
+#include <vector>
+
+struct Chunk;
+
+// Open addressing (linear probing) hash table of loaded chunks, keyed by packed chunk coordinates
+struct ChunkMapShard {
+	Mutex mtx;
+
+	Chunk *find_nolock(Int2 chunk_pos) const;
+
+	// Chunk must not exist yet
+	Chunk *insert_nolock(Int2 chunk_pos, uniqptr<Chunk> &&chunk);
+
+	// Frees chunk, returns false if not found
+	bool erase_nolock(Int2 chunk_pos);
+
+	u32 size_nolock() const {
+		return used;
+	}
+
+	template <typename Callback>
+	void forEach_nolock(Callback callback) const {
+		for(auto &slot : slots) {
+			if(slot.chunk)
+				callback(slot.chunk.get());
+		}
+	}
+
+private:
+	struct Slot {
+		u64 key = 0;
+		uniqptr<Chunk> chunk; // null = empty slot
+	};
+
+	std::vector<Slot> slots; // Size is always a power of two (or zero)
+	u32 used = 0;
+
+	void rehash_nolock(u32 new_capacity);
+};
+
+// Loaded chunks split into independently locked shards,
+// lookups of chunks in different shards do not block each other
+struct ChunkMap {
+	static constexpr u32 shard_count = 16;
+
+	static u64 packKey(Int2 chunk_pos) {
+		return ((u64)(u32)chunk_pos.x << 32) | (u64)(u32)chunk_pos.y;
+	}
+
+	static u64 hashKey(u64 key);
+
+	ChunkMapShard &getShard(Int2 chunk_pos);
+
+	ChunkMapShard &getShardByIndex(u32 index) {
+		return shards[index];
+	}
+
+	// Locks every shard in turn
+	template <typename Callback>
+	void forEach(Callback callback) {
+		for(auto &shard : shards) {
+			LockGuard lock(shard.mtx);
+			shard.forEach_nolock(callback);
+		}
+	}
+
+	///@returns all loaded chunks. Pointers stay valid as long as no chunk gets removed.
+	std::vector<Chunk *> collect();
+
+	u32 size();
+
+private:
+	ChunkMapShard shards[shard_count];
+};
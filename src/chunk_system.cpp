@@ -5,7 +5,9 @@
 #include "session.hpp"
 #include "util/timestep.hpp"
 #include "util/types.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -19,40 +21,100 @@ ChunkSystem::ChunkSystem(Room *room)
 	needs_garbage_collect = false;
 	step_ticks.setRate(20);
 
+	encoder_pool.create(room->settings.autosave_threads);
+
 	thr_runner = std::thread([this] {
 		runner();
 	});
 
+	for(u32 i = 0; i < room->settings.chunk_loader_threads; i++) {
+		thr_loaders.emplace_back([this] {
+			loader();
+		});
+	}
+
 	room->dispatcher_session_remove.add(listener_session_remove, [this](Session *removing_session) {
-		LockGuard lock(mtx_access);
-		// For every chunk
-		for(auto &i : chunks) {			// X
-			for(auto &j : i.second) { // Y
-				auto *chunk = j.second.get();
-				deannounceChunkForSession_nolock(removing_session, chunk->getPosition());
-			}
-		}
+		// Only chunks this session is subscribed to, linked chunks are never garbage collected
+		for(auto &chunk_pos : removing_session->getLinkedChunkPositions())
+			deannounceChunkForSession(removing_session, chunk_pos);
 	});
 }
 
 ChunkSystem::~ChunkSystem() {
-	running = false;
+	{
+		std::unique_lock lock(mtx_replay);
+		running = false;
+	}
+	cond_replay.notify_all();
 	if(thr_runner.joinable())
 		thr_runner.join();
+
+	{
+		std::unique_lock lock(mtx_load_queue);
+		loaders_running = false;
+	}
+	cond_load_queue.notify_all();
+
+	for(auto &thr : thr_loaders)
+		thr.join();
 }
 
-Chunk *ChunkSystem::getChunk(Int2 chunk_pos) {
-	LockGuard lock(mtx_access);
-	return getChunk_nolock(chunk_pos);
+Chunk *ChunkSystem::pinChunk(Int2 chunk_pos) {
+	Chunk *chunk;
+	{
+		// Pinned under the shard lock, the garbage collector checks pins while holding it
+		auto &shard = chunks.getShard(chunk_pos);
+		LockGuard lock(shard.mtx);
+		chunk = getChunk_nolock(shard, chunk_pos);
+		chunk->pin_count++;
+	}
+
+	chunk->waitUntilLoaded();
+	return chunk;
 }
 
-Chunk *ChunkSystem::getChunk_nolock(Int2 chunk_pos) {
-	if(last_accessed_chunk_cache && last_accessed_chunk_cache->position == chunk_pos)
-		return last_accessed_chunk_cache;
+void ChunkSystem::unpinChunk(Chunk *chunk) {
+	chunk->pin_count--;
+}
+
+Chunk *ChunkSystem::getChunk_nolock(ChunkMapShard &shard, Int2 chunk_pos) {
+	if(auto *chunk = shard.find_nolock(chunk_pos))
+		return chunk; // Loaded or already loading
+
+	// Chunk not found, create placeholder and load it in the background
+	auto *chunk = shard.insert_nolock(chunk_pos, makeUniq<Chunk>(this, chunk_pos));
+	{
+		std::unique_lock lock(mtx_load_queue);
+		load_queue.push(chunk_pos);
+	}
+	cond_load_queue.notify_one();
+
+	return chunk;
+}
+
+void ChunkSystem::waitForChunkLoad(Chunk *chunk) {
+	std::unique_lock lock(mtx_loaded);
+	cond_loaded.wait(lock, [chunk] {
+		return !chunk->isLoading();
+	});
+}
+
+void ChunkSystem::loader() {
+	while(true) {
+		Int2 chunk_pos;
+		{
+			std::unique_lock lock(mtx_load_queue);
+			cond_load_queue.wait(lock, [this] {
+				return !load_queue.empty() || !loaders_running;
+			});
+
+			if(load_queue.empty())
+				return; // Stopped
+
+			chunk_pos = load_queue.front();
+			load_queue.pop();
+		}
 
-	auto &horizontal = chunks[chunk_pos.x];
-	auto it = horizontal.find(chunk_pos.y);
-	if(it == horizontal.end()) {
 		SharedVector<u8> compressed_chunk_data;
 		{
 			// Load chunk pixels from database
@@ -64,29 +126,31 @@ Chunk *ChunkSystem::getChunk_nolock(Int2 chunk_pos) {
 				compressed_chunk_data = record.data;
 		}
 
-		// Chunk not found, create new chunk
-		auto &cell = horizontal[chunk_pos.y];
-		cell.create(this, chunk_pos, compressed_chunk_data);
-		last_accessed_chunk_cache = cell.get();
-		return cell.get();
-	} else {
-		last_accessed_chunk_cache = it->second.get();
-		return it->second.get();
+		{
+			// Placeholder is still there, loading chunks are not garbage collected
+			auto &shard = chunks.getShard(chunk_pos);
+			LockGuard lock(shard.mtx);
+			if(auto *chunk = shard.find_nolock(chunk_pos))
+				chunk->finishLoading(compressed_chunk_data);
+		}
+
+		{
+			std::unique_lock lock(mtx_loaded);
+		}
+		cond_loaded.notify_all();
 	}
 }
 
 bool ChunkSystem::getPixel(Int2 global_pixel_pos, Color *color) {
-	LockGuard lock(mtx_access);
-
 	auto chunk_pos = globalPixelPosToChunkPos(global_pixel_pos);
 
 	auto local_pixel_pos = globalPixelPosToLocalPixelPos(global_pixel_pos);
 
-	auto *chunk = getChunk_nolock(chunk_pos);
+	auto *chunk = pinChunk(chunk_pos);
 	chunk->lock();
-	chunk->allocateImage_nolock();
 	chunk->getPixel_nolock(local_pixel_pos, color);
 	chunk->unlock();
+	unpinChunk(chunk);
 
 	return true;
 }
@@ -121,81 +185,302 @@ UInt2 ChunkSystem::globalPixelPosToLocalPixelPos(Int2 global_pixel_pos) {
 }
 
 void ChunkSystem::announceChunkForSession(Session *session, Int2 chunk_pos) {
-	LockGuard lock(mtx_access);
-	announceChunkForSession_nolock(session, chunk_pos);
+	// Shard stays locked until linked, so the garbage collector can't free this chunk in the meantime
+	auto &shard = chunks.getShard(chunk_pos);
+	LockGuard lock(shard.mtx);
+	auto *chunk = getChunk_nolock(shard, chunk_pos);
+	session->linkChunk(chunk);
+	chunk->linkSession(session);
 }
 
 void ChunkSystem::deannounceChunkForSession(Session *session, Int2 chunk_pos) {
-	LockGuard lock(mtx_access);
-	deannounceChunkForSession_nolock(session, chunk_pos);
-}
-
-void ChunkSystem::announceChunkForSession_nolock(Session *session, Int2 chunk_pos) {
-	auto *chunk = getChunk_nolock(chunk_pos);
-	session->linkChunk(chunk);
-	chunk->linkSession(session);
+	auto &shard = chunks.getShard(chunk_pos);
+	LockGuard lock(shard.mtx);
+	if(auto *chunk = shard.find_nolock(chunk_pos))
+		unlinkChunkAndSession(session, chunk);
 }
 
-void ChunkSystem::deannounceChunkForSession_nolock(Session *session, Int2 chunk_pos) {
-	auto *chunk = getChunk_nolock(chunk_pos);
+void ChunkSystem::unlinkChunkAndSession(Session *session, Chunk *chunk) {
 	session->unlinkChunk(chunk);
 	chunk->unlinkSession(session);
 }
 
-void ChunkSystem::autosave() {
-	auto start = getMillis();
-	LockGuard lock(mtx_access);
+std::vector<ChunkSystem::EncodedChunk> ChunkSystem::encodeChunks(const std::vector<Chunk *> &to_encode) {
+	// Every chunk snapshots its stale bands under its own lock and compresses them unlocked,
+	// pixels can be written to chunks while they are being compressed
+	std::vector<EncodedChunk> encoded(to_encode.size());
+	encoder_pool->parallelFor(to_encode.size(), [&](u32 index) {
+		auto *chunk = to_encode[index];
+		encoded[index].position = chunk->getPosition();
+		encoded[index].data = chunk->encodeChunkData(true);
+	});
+	return encoded;
+}
 
-	std::vector<Chunk *> to_autosave;
-	u32 total_chunk_count = 0;
-	u32 saved_chunk_count = 0;
+u32 ChunkSystem::saveEncodedChunks(const std::vector<EncodedChunk> &encoded) {
+	if(encoded.empty())
+		return 0;
 
+	auto start = getMillis();
 	auto transaction = room->database.transactionBegin();
+	for(auto &e : encoded)
+		room->database.chunkSaveData(e.position, e.data->data(), e.data->size(), CompressionType::LZ4);
+	transaction->commit();
+	return getMillis() - start;
+}
+
+void ChunkSystem::replayJournal() {
+	std::unique_lock lock(mtx_replay);
+	replay_requested = true;
+	cond_replay.notify_all();
+	cond_replay.wait(lock, [this] {
+		return replay_done;
+	});
+}
 
-	for(auto &i : chunks) {
-		for(auto &j : i.second) {
-			auto *chunk = j.second.get();
-			total_chunk_count++;
+void ChunkSystem::runner_replayJournal() {
+	char path[256];
+	snprintf(path, sizeof(path), "rooms/%s.journal", room->getName().c_str());
 
-			if(chunk->isModified()) {
-				saveChunk_nolock(chunk);
-				saved_chunk_count++;
+	auto start = getMillis();
+	std::vector<ChunkPixel> pixels;
+	std::vector<u8> rgb;
+
+	// Journal is not open yet, replayed operations are not journaled again
+	u32 count = Journal::replay(path, [&](const JournalRecord &record) {
+		auto *chunk = pinChunk(record.chunk_pos);
+		auto *payload = record.payload;
+		u32 chunk_size = getChunkSize();
+
+		if(record.type == JournalRecordType::pixels) {
+			pixels.resize(record.payload_size / 5);
+			for(auto &pixel : pixels) {
+				pixel.pos = {payload[0], payload[1]};
+				pixel.color = Color(payload[2], payload[3], payload[4]);
+				payload += 5;
+			}
+			chunk->setPixels(pixels.data(), pixels.size());
+		} else if(record.type == JournalRecordType::rect && record.payload_size >= 8) {
+			u16 rect[4];
+			memcpy(rect, payload, sizeof(rect));
+			if(rect[0] + rect[2] <= chunk_size && rect[1] + rect[3] <= chunk_size) {
+				rgb.resize(rect[2] * rect[3] * 3);
+				if(decompressLZ4(payload + 8, record.payload_size - 8, rgb.data(), rgb.size()) == (int)rgb.size())
+					chunk->setRect({rect[0], rect[1]}, rect[2], rect[3], rgb.data(), rect[2] * 3);
 			}
 		}
-	}
 
-	transaction->commit();
+		unpinChunk(chunk);
+	});
 
-	if(saved_chunk_count) {
-		u32 dur = getMillis() - start;
-		room->log(LOG_CHUNK, "Autosaved %u chunks in %ums (%u chunks loaded)", saved_chunk_count, dur, total_chunk_count);
+	if(count) {
+		room->log(LOG_CHUNK, "Replayed %u journal records in %ums", count, (u32)(getMillis() - start));
+		autosave();
 	}
+
+	// Replayed records are saved, start with an empty journal
+	auto &settings = room->settings.journal;
+	if(!settings.enabled)
+		Journal::removeFiles(path);
+	else if(!journal.open(path, settings.sync))
+		room->log(LOG_CHUNK, "Failed to open journal %s", path);
 }
 
-void ChunkSystem::saveChunk_nolock(Chunk *chunk) {
-	auto chunk_data = chunk->encodeChunkData(true);
-	room->database.chunkSaveData(chunk->getPosition(), chunk_data->data(), chunk_data->size(), CompressionType::LZ4);
+void ChunkSystem::autosave() {
+	LockGuard lock_autosave(mtx_autosave);
+	auto start = getMillis();
+
+	// Every journaled operation up to now is covered by saving currently modified chunks
+	journal.beginCheckpoint();
+
+	u32 total_chunk_count = 0;
+	u32 saved_tile_count = 0;
+	size_t memory_usage = 0;
+
+	// Called by runner thread only, collected chunks can't be freed in the meantime
+	std::vector<Chunk *> modified_chunks;
+	for(auto *chunk : chunks.collect()) {
+		total_chunk_count++;
+
+		if(chunk->isModified()) {
+			saved_tile_count += chunk->getDirtyTileCount();
+			modified_chunks.push_back(chunk);
+		}
+
+		memory_usage += chunk->getMemoryUsage();
+	}
+
+	if(modified_chunks.empty()) {
+		journal.endCheckpoint();
+		return;
+	}
+
+	auto encode_start = getMillis();
+	auto encoded = encodeChunks(modified_chunks);
+	u32 encode_dur = getMillis() - encode_start;
+
+	// Only the database write is serialized (chunk loaders wait for it)
+	u32 stall_dur = saveEncodedChunks(encoded);
+	journal.endCheckpoint();
+
+	u32 dur = getMillis() - start;
+	room->log(LOG_CHUNK, "Autosaved %u chunks (%u modified tiles) in %ums (compression %ums on %u threads, database stall %ums), %u chunks loaded, %u KiB in memory, %.1f KiB per chunk",
+						(u32)encoded.size(), saved_tile_count, dur, encode_dur, encoder_pool->getThreadCount() + 1, stall_dur,
+						total_chunk_count, (u32)(memory_usage / 1024), (float)memory_usage / 1024.0f / total_chunk_count);
+
+	LockGuard lock(mtx_image_cache);
+	auto &c = image_cache;
+	room->log(LOG_CHUNK, "Image cache: %u/%u KiB used, %llu hits, %llu misses, %llu evictions",
+						(u32)(c.used_bytes / 1024), (u32)(room->settings.image_cache.budget_bytes / 1024),
+						(unsigned long long)c.hits, (unsigned long long)c.misses, (unsigned long long)c.evictions);
 }
 
-void ChunkSystem::removeChunk_nolock(Chunk *to_remove) {
-	if(to_remove == last_accessed_chunk_cache)
-		last_accessed_chunk_cache = nullptr;
+ChunkSystem::ImageCacheStats ChunkSystem::getImageCacheStats() {
+	LockGuard lock(mtx_image_cache);
+	ImageCacheStats stats;
+	stats.hits = image_cache.hits;
+	stats.misses = image_cache.misses;
+	stats.evictions = image_cache.evictions;
+	stats.used_bytes = image_cache.used_bytes;
+	stats.budget_bytes = room->settings.image_cache.budget_bytes;
+	return stats;
+}
 
-	for(auto it = chunks.begin(); it != chunks.end(); it++) {
-		for(auto jt = it->second.begin(); jt != it->second.end();) {
-			if(jt->second.get() == to_remove) {
-				it->second.erase(jt);
+void ChunkSystem::collectImageCacheStats_nolock(Chunk *chunk) {
+	image_cache.hits += chunk->image_cache_hits;
+	image_cache.misses += chunk->image_cache_misses;
+	chunk->image_cache_hits = 0;
+	chunk->image_cache_misses = 0;
+}
 
-				// Remove empty map row
-				if(it->second.empty())
-					it = chunks.erase(it);
+void ChunkSystem::trimImageCache() {
+	LockGuard lock(mtx_image_cache);
+
+	struct CachedImage {
+		Chunk *chunk;
+		u32 last_access;
+		size_t bytes;
+	};
+
+	std::vector<CachedImage> cached;
+	size_t used_bytes = 0;
+
+	// Called by runner thread only, collected chunks can't be freed in the meantime
+	for(auto *chunk : chunks.collect()) {
+		if(chunk->isLoading())
+			continue; // No image yet
+
+		chunk->lock();
+		collectImageCacheStats_nolock(chunk);
+		if(chunk->image) {
+			CachedImage entry;
+			entry.chunk = chunk;
+			entry.last_access = chunk->image_last_access;
+			entry.bytes = chunk->image->getMemoryUsage();
+			used_bytes += entry.bytes;
+			cached.push_back(entry);
+		}
+		chunk->unlock();
+	}
 
-				return;
-			} else {
-				jt++;
+	auto budget = room->settings.image_cache.budget_bytes;
+	if(used_bytes > budget) {
+		// Least recently used first
+		std::sort(cached.begin(), cached.end(), [](const CachedImage &a, const CachedImage &b) {
+			return a.last_access < b.last_access;
+		});
+
+		for(auto &entry : cached) {
+			if(used_bytes <= budget)
+				break;
+
+			// Modified chunks are skipped, their images are freed after they get saved
+			entry.chunk->lock();
+			if(entry.chunk->evictImage_nolock()) {
+				used_bytes -= entry.bytes;
+				image_cache.evictions++;
 			}
+			entry.chunk->unlock();
 		}
 	}
+
+	image_cache.used_bytes = used_bytes;
+}
+
+void ChunkSystem::removeChunk_nolock(ChunkMapShard &shard, Chunk *to_remove) {
+	{
+		LockGuard lock(mtx_image_cache);
+		to_remove->lock();
+		collectImageCacheStats_nolock(to_remove);
+		to_remove->unlock();
+	}
+
+	shard.erase_nolock(to_remove->getPosition());
+}
+
+void ChunkSystem::garbageCollect() {
+	auto start = getMillis();
+
+	// Pick unlinked chunks in a single pass
+	std::vector<Chunk *> candidates;
+	chunks.forEach([&](Chunk *chunk) {
+		if(chunk->isLinkedSessionsEmpty() && !chunk->isLoading() && !chunk->pin_count)
+			candidates.push_back(chunk);
+	});
+
+	if(candidates.empty())
+		return;
+
+	// Encode modified chunks without holding shard or database locks.
+	// Chunks are freed by this (runner) thread only, pointers stay valid.
+	std::vector<Chunk *> modified_candidates;
+	for(auto *chunk : candidates) {
+		if(chunk->isModified())
+			modified_candidates.push_back(chunk);
+	}
+
+	// Write all of them in a single transaction
+	auto encoded = encodeChunks(modified_candidates);
+	saveEncodedChunks(encoded);
+
+	// Erase, every shard is locked only for O(1) removal of a single chunk
+	auto erase_start = getMillis();
+	u32 removed_chunk_count = 0;
+
+	for(auto *chunk : candidates) {
+		auto &shard = chunks.getShard(chunk->getPosition());
+		LockGuard lock(shard.mtx);
+
+		// Linked, pinned, modified or queued pixels again in the meantime, keep it for the next run
+		if(!chunk->isLinkedSessionsEmpty() || chunk->pin_count || chunk->isModified() || chunk->in_flush_list)
+			continue;
+
+		removeChunk_nolock(shard, chunk);
+		removed_chunk_count++;
+	}
+
+	u32 erase_dur = getMillis() - erase_start;
+	u32 dur = getMillis() - start;
+	room->log(LOG_CHUNK, "GC: saved %u chunks, removed %u of %u candidates in %ums (erase pause %ums), %u chunks loaded",
+						(u32)encoded.size(), removed_chunk_count, (u32)candidates.size(), dur, erase_dur, chunks.size());
+}
+
+void ChunkSystem::addToFlushList(Chunk *chunk) {
+	chunk->next_in_flush_list = flush_list.load(std::memory_order_relaxed);
+	while(!flush_list.compare_exchange_weak(chunk->next_in_flush_list, chunk, std::memory_order_release, std::memory_order_relaxed)) {
+	}
+}
+
+void ChunkSystem::flushQueuedPixels() {
+	// Take the whole list at once, chunks queueing pixels from now on start a new one
+	auto *chunk = flush_list.exchange(nullptr, std::memory_order_acquire);
+	while(chunk) {
+		auto *next = chunk->next_in_flush_list;
+		// Cleared before flushing, pixels queued during the flush add the chunk again
+		chunk->in_flush_list = false;
+		chunk->flushQueuedPixels();
+		chunk = next;
+	}
 }
 
 void ChunkSystem::markGarbageCollect() {
@@ -203,8 +488,26 @@ void ChunkSystem::markGarbageCollect() {
 }
 
 void ChunkSystem::runner() {
+	{
+		// Room has to be fully constructed before replaying (autosave queues previews)
+		std::unique_lock lock(mtx_replay);
+		cond_replay.wait(lock, [this] {
+			return replay_requested || !running;
+		});
+	}
+
+	if(running) {
+		// Garbage collector doesn't run until replayed chunks are saved
+		runner_replayJournal();
+
+		std::unique_lock lock(mtx_replay);
+		replay_done = true;
+		cond_replay.notify_all();
+	}
+
 	last_autosave_timestamp = getMillis();
 	last_garbage_collect_timestamp = getMillis();
+	last_flush_timestamp = getMillis();
 
 	while(running) {
 		bool used = runner_tick();
@@ -232,63 +535,22 @@ bool ChunkSystem::runner_tick() {
 		last_garbage_collect_timestamp = millis;
 	}
 
+	if(last_flush_timestamp + room->settings.flush_interval <= millis) {
+		flushQueuedPixels();
+		journal.flush();
+		last_flush_timestamp = millis;
+	}
+
 	// Atomic operation:
 	// if(needs_garbage_collect) { needs_garbage_collect = false; (...) }
-	if(needs_garbage_collect.exchange(false)) {
-		LockGuard lock(mtx_access);
-
-		bool done = false;
-
-		// Informational use only
-		u32 saved_chunk_count = 0;
-		u32 removed_chunk_count = 0;
-		u32 loaded_chunk_count = 0;
-
-		do {
-			done = true;
-
-			loaded_chunk_count = 0;
-
-			// Iterate all loaded chunks as long as all chunks are deallocated
-			for(auto &i : chunks) {
-				loaded_chunk_count += i.second.size();
-				for(auto &j : i.second) {
-					auto *chunk = j.second.get();
-					if(chunk->isLinkedSessionsEmpty()) {
-						// Save chunk data to database (only if modified)
-						if(chunk->isModified()) {
-							saved_chunk_count++;
-							room->database.lock();
-							saveChunk_nolock(chunk);
-							room->database.unlock();
-						}
-						removed_chunk_count++;
-						removeChunk_nolock(chunk);
-						done = false;
-						goto breakloop;
-					}
-				}
-			}
-
-		breakloop:;
-
-		} while(!done);
-
-		if(saved_chunk_count || removed_chunk_count)
-			room->log(LOG_CHUNK, "Saved %u chunks, %u total chunks loaded, %u removed (GC))", saved_chunk_count, loaded_chunk_count, removed_chunk_count);
-	}
+	if(needs_garbage_collect.exchange(false))
+		garbageCollect();
 
 	while(step_ticks.onTick()) {
 		used = true;
 
-		if(ticks % 20 == 0) {
-			LockGuard lock(mtx_access);
-			for(auto &i : chunks) {
-				for(auto &j : i.second) {
-					j.second->flushQueuedPixels();
-				}
-			}
-		}
+		if(ticks % 100 == 0)
+			trimImageCache();
 
 		ticks++;
 	}
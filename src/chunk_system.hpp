@@ -1,16 +1,21 @@
 #pragma once
 
+#include "chunk_map.hpp"
 #include "color.hpp"
 #include "database.hpp"
+#include "journal.hpp"
 #include "util/listener.hpp"
 #include "util/mutex.hpp"
 #include "util/smartptr.hpp"
+#include "util/thread_pool.hpp"
 #include "util/timestep.hpp"
 #include "util/types.hpp"
 #include <atomic>
-#include <map>
+#include <condition_variable>
 #include <mutex>
+#include <queue>
 #include <thread>
+#include <vector>
 
 struct Room;
 struct Session;
@@ -20,32 +25,89 @@ struct ChunkSystem {
 	Room *room;
 
 private:
-	Mutex mtx_access;
-	std::map<s32, std::map<s32, uniqptr<Chunk>>> chunks;
-
-	Chunk *last_accessed_chunk_cache = nullptr;
+	// Loaded chunks. Chunks are removed by the runner thread only (garbage collector),
+	// so runner can iterate collected chunk pointers without holding shard locks.
+	ChunkMap chunks;
 
 	std::atomic<bool> running;
 	std::thread thr_runner;
 
+	// Chunk loader pool, every queued position has a loading placeholder in chunks
+	std::mutex mtx_load_queue;
+	std::condition_variable cond_load_queue;
+	std::queue<Int2> load_queue;
+	bool loaders_running = true;
+	std::vector<std::thread> thr_loaders;
+
+	// Compresses chunks for autosave and garbage collector
+	uniqptr<ThreadPool> encoder_pool;
+
+	// Notified when any chunk finishes loading
+	std::mutex mtx_loaded;
+	std::condition_variable cond_loaded;
+
+	// Pixel operations since the last autosave checkpoint
+	Journal journal;
+	Mutex mtx_autosave;
+
+	// Runner replays the journal before its first tick, replayJournal() waits for it
+	std::mutex mtx_replay;
+	std::condition_variable cond_replay;
+	bool replay_requested = false;
+	bool replay_done = false;
+
 	u64 last_autosave_timestamp;
 	u64 last_garbage_collect_timestamp;
+	u64 last_flush_timestamp;
+
+	// Lock-free stack of chunks with queued pixels, linked through Chunk::next_in_flush_list
+	std::atomic<Chunk *> flush_list = nullptr;
 
 	std::atomic<bool> needs_garbage_collect;
 
 	Listener<void(Session *)> listener_session_remove;
 
 	Timestep step_ticks;
-	u32 ticks = 0;
+	std::atomic<u32> ticks = 0;
+
+	Mutex mtx_image_cache;
+	struct {
+		u64 hits = 0;
+		u64 misses = 0;
+		u64 evictions = 0;
+		size_t used_bytes = 0;
+	} image_cache;
 
 public:
 	ChunkSystem(Room *room);
 	~ChunkSystem();
 
+	Journal &getJournal() {
+		return journal;
+	}
+
+	// Applies operations journaled since the last checkpoint (e.g. before a crash), saves them and starts journaling.
+	// Runs on the runner thread, blocks until done.
+	void replayJournal();
+
 	static u32 getChunkSize() {
 		return 256;
 	}
 
+	u32 getTicks() const {
+		return ticks.load(std::memory_order_relaxed);
+	}
+
+	struct ImageCacheStats {
+		u64 hits;			 // Image accessed while decompressed
+		u64 misses;		 // Image had to be decompressed again
+		u64 evictions; // Images dropped to stay within budget
+		size_t used_bytes;
+		size_t budget_bytes;
+	};
+
+	ImageCacheStats getImageCacheStats();
+
 	bool getPixel(Int2 global_pixel_pos, Color *color);
 
 	///@returns chunk coordinates from global pixel position
@@ -59,21 +121,53 @@ public:
 
 	void markGarbageCollect();
 
-	Chunk *getChunk(Int2 chunk_pos);
+	// Waits until chunk is loaded. The chunk is never freed by the garbage collector until unpinChunk() is called.
+	Chunk *pinChunk(Int2 chunk_pos);
+	void unpinChunk(Chunk *chunk);
+
+	void waitForChunkLoad(Chunk *chunk);
+
+	// Called by chunk after queueing pixels, chunk is flushed within flush_interval
+	void addToFlushList(Chunk *chunk);
 
 private:
-	// Never returns null
-	Chunk *getChunk_nolock(Int2 chunk_pos);
+	// Creates loading placeholder and queues its load if not loaded yet, shard has to be locked. Never returns null
+	Chunk *getChunk_nolock(ChunkMapShard &shard, Int2 chunk_pos);
+
+	void loader();
 
-	// Save chunk to database and free it
-	void removeChunk_nolock(Chunk *to_remove);
+	// Free chunk (has to be saved already), shard has to be locked
+	void removeChunk_nolock(ChunkMapShard &shard, Chunk *to_remove);
 
 	void runner();
 	bool runner_tick();
+	void runner_replayJournal();
+
+	// Sends queued pixels of chunks in the flush list
+	void flushQueuedPixels();
 
-	void announceChunkForSession_nolock(Session *session, Int2 chunk_pos);
-	void deannounceChunkForSession_nolock(Session *session, Int2 chunk_pos);
+	// Saves and frees chunks without linked sessions
+	void garbageCollect();
+
+	void unlinkChunkAndSession(Session *session, Chunk *chunk);
 
 	void autosave();
-	void saveChunk_nolock(Chunk *chunk);
+
+	struct EncodedChunk {
+		Int2 position;
+		SharedVector<u8> data;
+	};
+
+	// Compresses chunks for storage on the encoder pool, clears their modified flag
+	std::vector<EncodedChunk> encodeChunks(const std::vector<Chunk *> &to_encode);
+
+	// Writes encoded chunks in a single transaction
+	///@returns milliseconds the database was locked
+	u32 saveEncodedChunks(const std::vector<EncodedChunk> &encoded);
+
+	// Add image cache counters of the chunk to totals and reset them
+	void collectImageCacheStats_nolock(Chunk *chunk);
+
+	// Free decompressed images of least recently used chunks exceeding the image cache budget
+	void trimImageCache();
 };
\ No newline at end of file
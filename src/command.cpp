@@ -4,6 +4,7 @@
 #include "session.hpp"
 #include "util/buffer.hpp"
 #include "util/byteswap.hpp"
+#include <algorithm>
 #include <cassert>
 
 static_assert(sizeof(ClientCmd) == 2);
@@ -177,16 +178,136 @@ Packet preparePacketMessage(MessageType type, const char *message) {
 	return preparePacket(ServerCmd::message, buf.data(), buf.size());
 }
 
-SharedVector<u8> compressLZ4(const void *data, u32 raw_size) NO_SANITIZER {
+Packet preparePacketProcessingStatusText(std::string_view text) {
+	return preparePacket(ServerCmd::processing_status_text, text.data(), text.size());
+}
+
+SharedVector<u8> compressLZ4(const void *data, u32 raw_size, s32 acceleration) NO_SANITIZER {
+	auto max_dst_size = LZ4_compressBound(raw_size);
+	auto compressed = createSharedVector<u8>(max_dst_size);
+	auto compressed_data_size = LZ4_compress_fast((const char *)data, (char *)compressed->data(), raw_size, max_dst_size, acceleration);
+	assert(compressed_data_size > 0);
+	compressed->resize(compressed_data_size);
+	compressed->shrink_to_fit();
+	return compressed;
+}
+
+SharedVector<u8> compressLZ4HC(const void *data, u32 raw_size, s32 level) NO_SANITIZER {
 	auto max_dst_size = LZ4_compressBound(raw_size);
 	auto compressed = createSharedVector<u8>(max_dst_size);
-	auto compressed_data_size = LZ4_compress_HC((const char *)data, (char *)compressed->data(), raw_size, max_dst_size, LZ4HC_CLEVEL_MAX);
+	auto compressed_data_size = LZ4_compress_HC((const char *)data, (char *)compressed->data(), raw_size, max_dst_size, std::min(level, LZ4HC_CLEVEL_MAX));
 	assert(compressed_data_size > 0);
 	compressed->resize(compressed_data_size);
 	compressed->shrink_to_fit();
 	return compressed;
 }
 
+namespace {
+	struct LZ4Sequence {
+		u32 token_pos;		// Position of the sequence token
+		u32 literals_pos; // Position of the first literal
+		u32 literals_len;
+		u32 end_pos; // Position after the sequence (next token)
+	};
+
+	u32 readLZ4Length(const u8 *data, u32 size, u32 *pos, u32 length) {
+		if(length != 15)
+			return length;
+		u8 v;
+		do {
+			assert(*pos < size);
+			v = data[(*pos)++];
+			length += v;
+		} while(v == 255);
+		return length;
+	}
+
+	// Parses a single sequence starting at pos
+	LZ4Sequence readLZ4Sequence(const u8 *data, u32 size, u32 pos) {
+		LZ4Sequence seq;
+		seq.token_pos = pos;
+		u8 token = data[pos++];
+		seq.literals_len = readLZ4Length(data, size, &pos, token >> 4);
+		seq.literals_pos = pos;
+		pos += seq.literals_len;
+		if(pos < size) {
+			pos += 2; // Match offset
+			readLZ4Length(data, size, &pos, token & 0x0F);
+		}
+		seq.end_pos = pos;
+		return seq;
+	}
+
+	void writeLZ4Token(std::vector<u8> &out, u32 literals_len, u8 match_nibble) {
+		out.push_back((u8)(std::min(literals_len, 15u) << 4) | match_nibble);
+		if(literals_len >= 15) {
+			u32 n = literals_len - 15;
+			while(n >= 255) {
+				out.push_back(255);
+				n -= 255;
+			}
+			out.push_back((u8)n);
+		}
+	}
+} // namespace
+
+SharedVector<u8> joinLZ4Blocks(const SharedVector<u8> *blocks, u32 count) NO_SANITIZER {
+	// Every LZ4 block ends with a literal-only sequence. These trailing literals are carried over
+	// and merged into the first sequence of the next block. Matches only reference data
+	// within their own block, so their offsets stay valid after joining.
+	struct Span {
+		const u8 *data;
+		u32 size;
+	};
+	std::vector<Span> carry;
+	u32 carry_len = 0;
+
+	size_t total_size = 0;
+	for(u32 i = 0; i < count; i++)
+		total_size += blocks[i]->size();
+
+	auto joined = createSharedVector<u8>(0);
+	auto &out = *joined;
+	out.reserve(total_size + count * 8);
+
+	for(u32 i = 0; i < count; i++) {
+		const u8 *data = blocks[i]->data();
+		u32 size = blocks[i]->size();
+
+		auto first = readLZ4Sequence(data, size, 0);
+		if(first.end_pos >= size) {
+			// Literals only
+			carry.push_back({data + first.literals_pos, first.literals_len});
+			carry_len += first.literals_len;
+			continue;
+		}
+
+		// Find last sequence
+		auto last = first;
+		while(last.end_pos < size)
+			last = readLZ4Sequence(data, size, last.end_pos);
+
+		// Merge carried literals with the first sequence
+		writeLZ4Token(out, carry_len + first.literals_len, data[0] & 0x0F);
+		for(auto &span : carry)
+			out.insert(out.end(), span.data, span.data + span.size);
+
+		// First literals, its match and all following sequences except the last one
+		out.insert(out.end(), data + first.literals_pos, data + last.token_pos);
+
+		carry.clear();
+		carry.push_back({data + last.literals_pos, last.literals_len});
+		carry_len = last.literals_len;
+	}
+
+	// Final, literal-only sequence
+	writeLZ4Token(out, carry_len, 0);
+	for(auto &span : carry)
+		out.insert(out.end(), span.data, span.data + span.size);
+
+	return joined;
+}
+
 int decompressLZ4(const void *compressed_data, u32 compressed_size, void *raw_data, u32 raw_size) NO_SANITIZER {
 	return LZ4_decompress_safe((const char *)compressed_data, (char *)raw_data, compressed_size, raw_size);
 }
\ No newline at end of file
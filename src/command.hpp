@@ -5,6 +5,7 @@
 #include "util/smartptr.hpp"
 #include "util/types.hpp"
 #include <memory>
+#include <string_view>
 
 DECLARE_ID(SessionID, u16);
 
@@ -27,7 +28,7 @@ enum struct MessageType : u8 {
 
 enum struct ClientCmd : u16 {
 	message = 1,	// utf-8 text
-	announce = 2, // u8 room_name_size, utf-8 room_name, u8 nickname_size, utf-8 nickname
+	announce = 2, // u8 room_name_size, utf-8 room_name, u8 nickname_size, utf-8 nickname, optional u8 capabilities (ClientCapability flags)
 	ping = 4,
 	cursor_pos = 100, // s32 x, s32 y
 	cursor_down = 101,
@@ -41,12 +42,19 @@ enum struct ClientCmd : u16 {
 	undo = 203
 };
 
+// Optional protocol features announced by the client
+enum struct ClientCapability : u8 {
+	batch_frames = 1 // Understands ServerCmd::batch
+};
+
 enum struct ServerCmd : u16 {
 	message = 1,									 // u8 type, utf-8 text
 	your_id = 2,									 // u16 id
 	kick = 3,											 // utf-8 reason
+	batch = 4,										 // repeated: u32 size, packet (u16 command + data)
 	chunk_image = 100,						 // complex data
 	chunk_pixel_pack = 101,				 // complex data
+	chunk_rect_pack = 102,				 // s32 chunkX, s32 chunkY, u16 x, u16 y, u16 width, u16 height, LZ4 compressed RGB rows
 	chunk_create = 110,						 // s32 chunkX, s32 chunkY
 	chunk_remove = 111,						 // s32 chunkX, s32 chunkY
 	preview_image = 200,					 // s32 previewX, s32 previewY, u8 zoom, complex data
@@ -90,6 +98,7 @@ Packet preparePacketUserRemove(Session *session);
 Packet preparePacketChunkCreate(Int2 chunk_pos);
 Packet preparePacketChunkRemove(Int2 chunk_pos);
 Packet preparePacketMessage(MessageType type, const char *message);
+Packet preparePacketProcessingStatusText(std::string_view text);
 
 template <typename T>
 using SharedVector = std::shared_ptr<std::vector<T>>;
@@ -99,7 +108,15 @@ inline SharedVector<T> createSharedVector(size_t count) {
 	return std::make_shared<std::vector<T>>(count);
 }
 
-SharedVector<u8> compressLZ4(const void *data, u32 raw_size) NO_SANITIZER;
+// Fast LZ4 compression, used for data sent to clients immediately. Higher acceleration = faster, worse ratio
+SharedVector<u8> compressLZ4(const void *data, u32 raw_size, s32 acceleration) NO_SANITIZER;
+
+// Slow LZ4HC compression (same decoder), used for data stored in the database
+SharedVector<u8> compressLZ4HC(const void *data, u32 raw_size, s32 level) NO_SANITIZER;
+
+// Joins independently compressed LZ4 blocks into a single block, which decompresses to their concatenated raw data.
+// Used to re-encode only modified parts of an image.
+SharedVector<u8> joinLZ4Blocks(const SharedVector<u8> *blocks, u32 count) NO_SANITIZER;
 
 ///@returns <= 0 on failure
 int decompressLZ4(const void *compressed_data, u32 compressed_size, void *raw_data, u32 raw_size) NO_SANITIZER;
\ No newline at end of file
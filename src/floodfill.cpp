@@ -0,0 +1,201 @@
+#include "floodfill.hpp"
+#include "chunk.hpp"
+#include "server.hpp"
+#include <cstdlib>
+
+static_assert(ChunkImage::size == 256, "Global to chunk position uses shifts");
+
+static inline Int2 getChunkPos(s32 x, s32 y) {
+	return {x >> 8, y >> 8}; // Arithmetic shift, rounds negative positions down
+}
+
+static inline u32 getPixelIndex(s32 x, s32 y) {
+	return (u32)(y & 255) * ChunkImage::size + (u32)(x & 255);
+}
+
+void Floodfill::begin(Int2 global_pos, Color to_replace, Color color, s32 max_distance, std::function<Chunk *(Int2 chunk_pos)> get_chunk) {
+	reset();
+	this->to_replace = to_replace;
+	this->color = color;
+	this->start = global_pos;
+	this->max_distance = max_distance;
+	this->get_chunk = std::move(get_chunk);
+	seeds.push_back({global_pos.x, global_pos.y});
+	processing = true;
+}
+
+void Floodfill::reset() {
+	chunks.clear();
+	last_chunk = nullptr;
+	seeds.clear();
+	get_chunk = nullptr;
+	filled_count = 0;
+	processing = false;
+}
+
+Floodfill::FillChunk *Floodfill::getFillChunk(Int2 chunk_pos) {
+	if(last_chunk && last_chunk_pos == chunk_pos)
+		return last_chunk;
+
+	auto &fill_chunk = chunks[chunk_pos];
+	if(!fill_chunk) {
+		fill_chunk.create();
+		if(auto *chunk = get_chunk(chunk_pos)) {
+			fill_chunk->chunk = chunk;
+			fill_chunk->rgb.create(pixel_count * 3);
+			chunk->lock();
+			chunk->getRGB_nolock(fill_chunk->rgb.data());
+			chunk->unlock();
+		}
+	}
+
+	last_chunk = fill_chunk.get();
+	last_chunk_pos = chunk_pos;
+	return last_chunk;
+}
+
+bool Floodfill::isFillable(s32 x, s32 y) {
+	if(abs(x - start.x) > max_distance || abs(y - start.y) > max_distance)
+		return false;
+
+	auto *fill_chunk = getFillChunk(getChunkPos(x, y));
+	if(!fill_chunk->chunk)
+		return false;
+
+	u32 index = getPixelIndex(x, y);
+	if(fill_chunk->filled[index])
+		return false;
+
+	auto *rgb = fill_chunk->rgb.data() + index * 3;
+	return rgb[0] == to_replace.r && rgb[1] == to_replace.g && rgb[2] == to_replace.b;
+}
+
+void Floodfill::fillSpan(s32 start_x, s32 end_x, s32 y) {
+	// Split into chunk rows
+	for(s32 x = start_x; x <= end_x;) {
+		auto *fill_chunk = getFillChunk(getChunkPos(x, y));
+		s32 segment_end = std::min(end_x, x | 255);
+
+		u32 local_y = y & 255;
+		u32 local_start = x & 255;
+		u32 local_end = segment_end & 255;
+		u32 row = local_y * ChunkImage::size;
+		for(u32 local_x = local_start; local_x <= local_end; local_x++) {
+			fill_chunk->filled[row + local_x] = true;
+			fill_chunk->pending[row + local_x] = true;
+		}
+
+		if(!fill_chunk->has_pending) {
+			fill_chunk->pending_start_x = local_start;
+			fill_chunk->pending_end_x = local_end;
+			fill_chunk->pending_start_y = local_y;
+			fill_chunk->pending_end_y = local_y;
+			fill_chunk->has_pending = true;
+		} else {
+			fill_chunk->pending_start_x = std::min(fill_chunk->pending_start_x, local_start);
+			fill_chunk->pending_end_x = std::max(fill_chunk->pending_end_x, local_end);
+			fill_chunk->pending_start_y = std::min(fill_chunk->pending_start_y, local_y);
+			fill_chunk->pending_end_y = std::max(fill_chunk->pending_end_y, local_y);
+		}
+
+		x = segment_end + 1;
+	}
+
+	filled_count += end_x - start_x + 1;
+}
+
+void Floodfill::pushSeeds(s32 start_x, s32 end_x, s32 y) {
+	// One seed per run of fillable pixels
+	bool in_run = false;
+	for(s32 x = start_x; x <= end_x; x++) {
+		if(isFillable(x, y)) {
+			if(!in_run)
+				seeds.push_back({x, y});
+			in_run = true;
+		} else {
+			in_run = false;
+		}
+	}
+}
+
+bool Floodfill::process(u32 time_budget_ms) {
+	if(!processing)
+		return true;
+
+	auto time_start = getMillis();
+	u32 spans = 0;
+
+	while(!seeds.empty()) {
+		auto seed = seeds.back();
+		seeds.pop_back();
+
+		if(!isFillable(seed.x, seed.y))
+			continue; // Filled by another span already
+
+		s32 start_x = seed.x;
+		while(isFillable(start_x - 1, seed.y))
+			start_x--;
+
+		s32 end_x = seed.x;
+		while(isFillable(end_x + 1, seed.y))
+			end_x++;
+
+		fillSpan(start_x, end_x, seed.y);
+		pushSeeds(start_x, end_x, seed.y - 1);
+		pushSeeds(start_x, end_x, seed.y + 1);
+
+		if(++spans % 1024 == 0 && getMillis() > time_start + time_budget_ms)
+			return false;
+	}
+
+	return true;
+}
+
+void Floodfill::commit(const std::function<void(Int2 global_pos, Color previous)> &on_replaced) {
+	uniqdata<u8> rgb;
+
+	for(auto &[chunk_pos, fill_chunk] : chunks) {
+		if(!fill_chunk->has_pending)
+			continue;
+
+		if(!rgb)
+			rgb.create(pixel_count * 3);
+
+		auto *chunk = fill_chunk->chunk;
+		u32 pitch = ChunkImage::size * 3;
+		u32 start_x = fill_chunk->pending_start_x;
+		u32 start_y = fill_chunk->pending_start_y;
+		u32 width = fill_chunk->pending_end_x - start_x + 1;
+		u32 height = fill_chunk->pending_end_y - start_y + 1;
+
+		chunk->lock();
+
+		// Pixels queued earlier must not reach clients after the rect
+		chunk->flushQueuedPixels_nolock();
+
+		// Current image, may be modified by others since it was copied
+		chunk->getRGB_nolock(rgb.data());
+		for(u32 y = start_y; y < start_y + height; y++) {
+			for(u32 x = start_x; x < start_x + width; x++) {
+				u32 index = y * ChunkImage::size + x;
+				if(!fill_chunk->pending[index])
+					continue;
+
+				auto *pixel = rgb.data() + index * 3;
+				if(pixel[0] != to_replace.r || pixel[1] != to_replace.g || pixel[2] != to_replace.b)
+					continue;
+
+				pixel[0] = color.r;
+				pixel[1] = color.g;
+				pixel[2] = color.b;
+				on_replaced({chunk_pos.x * (s32)ChunkImage::size + (s32)x, chunk_pos.y * (s32)ChunkImage::size + (s32)y}, to_replace);
+			}
+		}
+
+		chunk->setRect_nolock({start_x, start_y}, width, height, rgb.data() + start_y * pitch + start_x * 3, pitch);
+		chunk->unlock();
+
+		fill_chunk->pending.reset();
+		fill_chunk->has_pending = false;
+	}
+}
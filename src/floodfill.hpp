@@ -0,0 +1,72 @@
+#pragma once
+
+#include "chunk_image.hpp"
+#include "color.hpp"
+#include "util/smartptr.hpp"
+#include "util/types.hpp"
+#include <bitset>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+struct Chunk;
+
+// Scanline flood fill working on RGB copies of chunk images.
+// Every touched chunk is locked once to copy its image, visited pixels are tracked in a bitmap
+// and filled spans are written back to chunks by commit() (one lock and one rect per chunk).
+struct Floodfill {
+private:
+	static constexpr u32 pixel_count = ChunkImage::size * ChunkImage::size;
+
+	struct FillChunk {
+		Chunk *chunk = nullptr; // nullptr = not available, acts as a border
+		uniqdata<u8> rgb;				// Image copy taken when the chunk was touched first
+		std::bitset<pixel_count> filled;
+		std::bitset<pixel_count> pending; // Filled, not committed yet
+		u32 pending_start_x, pending_start_y, pending_end_x, pending_end_y;
+		bool has_pending = false;
+	};
+
+	struct Seed {
+		s32 x, y;
+	};
+
+	std::function<Chunk *(Int2 chunk_pos)> get_chunk;
+	std::unordered_map<Int2, uniqptr<FillChunk>, Int2Hash> chunks;
+	FillChunk *last_chunk = nullptr;
+	Int2 last_chunk_pos;
+
+	std::vector<Seed> seeds;
+	Color to_replace;
+	Color color;
+	Int2 start;
+	s32 max_distance = 0;
+	u32 filled_count = 0;
+	bool processing = false;
+
+	FillChunk *getFillChunk(Int2 chunk_pos);
+	bool isFillable(s32 x, s32 y);
+	void fillSpan(s32 start_x, s32 end_x, s32 y);
+	void pushSeeds(s32 start_x, s32 end_x, s32 y);
+
+public:
+	///@param get_chunk returns chunk the fill is allowed to touch (or nullptr), called once per chunk
+	void begin(Int2 global_pos, Color to_replace, Color color, s32 max_distance, std::function<Chunk *(Int2 chunk_pos)> get_chunk);
+
+	///@returns true if finished (nothing left to fill)
+	bool process(u32 time_budget_ms);
+
+	/// Writes filled pixels to chunks and sends them to linked sessions. Pixels changed by someone else
+	/// in the meantime are skipped. on_replaced is called for every written pixel (with its previous color).
+	void commit(const std::function<void(Int2 global_pos, Color previous)> &on_replaced);
+
+	void reset();
+
+	bool isProcessing() const {
+		return processing;
+	}
+
+	u32 getFilledCount() const {
+		return filled_count;
+	}
+};
@@ -0,0 +1,174 @@
+#include "job_system.hpp"
+#include "chunk_system.hpp"
+#include "server.hpp"
+#include <algorithm>
+
+Job::Job(std::string name, const char *progress_unit, u32 item_count, ProcessCallback process)
+		: name(std::move(name)), progress_unit(progress_unit), item_count(item_count), process(std::move(process)) {
+}
+
+void Job::setOnProgress(JobCallback callback) {
+	on_progress = std::move(callback);
+}
+
+void Job::setOnFinish(JobCallback callback) {
+	on_finish = std::move(callback);
+}
+
+void Job::cancel() {
+	cancelled = true;
+}
+
+bool Job::isCancelled() const {
+	return cancelled;
+}
+
+void Job::addProgress(u64 count) {
+	progress += count;
+
+	if(!on_progress)
+		return;
+
+	// Throttled, only a single thread reports at a time
+	auto now = getMillis();
+	auto last = last_progress_millis.load();
+	if(now < last + 100 || !last_progress_millis.compare_exchange_strong(last, now))
+		return;
+
+	on_progress(*this);
+}
+
+u64 Job::getProgress() const {
+	return progress;
+}
+
+const std::string &Job::getName() const {
+	return name;
+}
+
+const char *Job::getProgressUnit() const {
+	return progress_unit;
+}
+
+Chunk *Job::pinChunk(Int2 chunk_pos) {
+	auto *chunk = chunk_system->pinChunk(chunk_pos);
+	LockGuard lock(mtx_pinned);
+	pinned_chunks.push_back(chunk);
+	return chunk;
+}
+
+JobSystem::JobSystem(ChunkSystem *chunk_system, u32 thread_count)
+		: chunk_system(chunk_system) {
+	pool.create(thread_count);
+}
+
+JobSystem::~JobSystem() {
+	stopping = true;
+	cancelAll();
+	pool.reset(); // Runs remaining (skipped) items and finish callbacks
+}
+
+void JobSystem::cancelAll() {
+	LockGuard lock(mtx_owners);
+	for(auto &weak : running_jobs) {
+		if(auto job = weak.lock())
+			job->cancel();
+	}
+}
+
+std::shared_ptr<Job> JobSystem::createChunkJob(std::string name, std::vector<Int2> chunk_positions,
+																							 std::function<void(Job &job, Chunk *chunk, u32 index)> process) {
+	u32 count = chunk_positions.size();
+	return std::make_shared<Job>(std::move(name), "chunks", count,
+															 [positions = std::move(chunk_positions), process = std::move(process)](Job &job, u32 index) {
+																 process(job, job.pinChunk(positions[index]), index);
+																 job.addProgress(1);
+															 });
+}
+
+void JobSystem::submit(const std::shared_ptr<Job> &job, const void *owner) {
+	job->chunk_system = chunk_system;
+
+	{
+		LockGuard lock(mtx_owners);
+
+		// Forget finished jobs
+		running_jobs.erase(std::remove_if(running_jobs.begin(), running_jobs.end(), [](const std::weak_ptr<Job> &weak) {
+												 return weak.expired();
+											 }),
+											 running_jobs.end());
+		running_jobs.push_back(job);
+
+		if(owner) {
+			auto &last = last_job_by_owner[owner];
+			bool wait = last && !last->finished;
+			if(wait)
+				last->next = job;
+			last = job;
+			if(wait)
+				return; // Started by the previous job
+		}
+	}
+
+	start(job);
+}
+
+void JobSystem::start(const std::shared_ptr<Job> &job) {
+	if(stopping)
+		job->cancel();
+
+	if(job->item_count == 0) {
+		finish(job);
+		return;
+	}
+
+	// Every runner takes items until none are left
+	u32 runner_count = std::min(pool->getThreadCount(), job->item_count);
+	for(u32 i = 0; i < runner_count; i++) {
+		pool->post([this, job] {
+			runItems(job);
+		});
+	}
+}
+
+void JobSystem::runItems(const std::shared_ptr<Job> &job) {
+	u32 index;
+	while((index = job->next_index.fetch_add(1)) < job->item_count) {
+		if(!job->cancelled)
+			job->process(*job, index);
+
+		if(job->done_count.fetch_add(1) + 1 == job->item_count) {
+			finish(job);
+			return;
+		}
+	}
+}
+
+void JobSystem::finish(const std::shared_ptr<Job> &job) {
+	{
+		LockGuard lock(job->mtx_pinned);
+		for(auto *chunk : job->pinned_chunks)
+			chunk_system->unpinChunk(chunk);
+		job->pinned_chunks.clear();
+	}
+
+	if(job->on_finish)
+		job->on_finish(*job);
+
+	std::shared_ptr<Job> next;
+	{
+		LockGuard lock(mtx_owners);
+		job->finished = true;
+		next = std::move(job->next);
+
+		for(auto it = last_job_by_owner.begin(); it != last_job_by_owner.end(); it++) {
+			if(it->second == job) {
+				last_job_by_owner.erase(it);
+				break;
+			}
+		}
+	}
+
+	if(next)
+		start(next);
+}
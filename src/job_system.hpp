@@ -0,0 +1,98 @@
+#pragma once
+
+#include "util/mutex.hpp"
+#include "util/smartptr.hpp"
+#include "util/thread_pool.hpp"
+#include "util/types.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Chunk;
+struct ChunkSystem;
+
+// Long-running edit operation (floodfill, undo, plugin blits) split into work items.
+// Items of a single job are processed in parallel by room job threads.
+struct Job {
+	friend struct JobSystem;
+
+	typedef std::function<void(Job &job, u32 index)> ProcessCallback;
+	typedef std::function<void(Job &job)> JobCallback;
+
+private:
+	std::string name;
+	const char *progress_unit;
+	u32 item_count;
+	ProcessCallback process;
+	JobCallback on_progress;
+	JobCallback on_finish;
+
+	std::atomic<u32> next_index = 0;
+	std::atomic<u32> done_count = 0;
+	std::atomic<u64> progress = 0;
+	std::atomic<u64> last_progress_millis = 0;
+	std::atomic<bool> cancelled = false;
+	bool finished = false; // Guarded by JobSystem::mtx_owners
+
+	ChunkSystem *chunk_system = nullptr;
+	Mutex mtx_pinned;
+	std::vector<Chunk *> pinned_chunks;
+
+	// Next job of the same owner, started when this one finishes
+	std::shared_ptr<Job> next;
+
+public:
+	///@param progress_unit progress counter unit shown to the user, e.g. "pixels"
+	Job(std::string name, const char *progress_unit, u32 item_count, ProcessCallback process);
+
+	// Called from job threads, at most every 100 ms
+	void setOnProgress(JobCallback callback);
+	// Called once from a job thread after all items were processed (or skipped if cancelled)
+	void setOnFinish(JobCallback callback);
+
+	// Remaining items are skipped, items already running should check isCancelled()
+	void cancel();
+	bool isCancelled() const;
+
+	void addProgress(u64 count);
+	u64 getProgress() const;
+
+	const std::string &getName() const;
+	const char *getProgressUnit() const;
+
+	// Loads chunk (if needed) and keeps it in memory until the job finishes
+	Chunk *pinChunk(Int2 chunk_pos);
+};
+
+struct JobSystem {
+private:
+	ChunkSystem *chunk_system;
+	uniqptr<ThreadPool> pool;
+	std::atomic<bool> stopping = false;
+
+	Mutex mtx_owners;
+	std::unordered_map<const void *, std::shared_ptr<Job>> last_job_by_owner;
+	std::vector<std::weak_ptr<Job>> running_jobs;
+
+	void start(const std::shared_ptr<Job> &job);
+	void runItems(const std::shared_ptr<Job> &job);
+	void finish(const std::shared_ptr<Job> &job);
+
+public:
+	JobSystem(ChunkSystem *chunk_system, u32 thread_count);
+
+	// Cancels all jobs and waits for job threads
+	~JobSystem();
+
+	///@param owner jobs with the same owner run one after another in submission order, nullptr = unordered
+	void submit(const std::shared_ptr<Job> &job, const void *owner);
+
+	void cancelAll();
+
+	///@returns job with one item per chunk, every chunk is pinned before process is called
+	static std::shared_ptr<Job> createChunkJob(std::string name, std::vector<Int2> chunk_positions,
+																						 std::function<void(Job &job, Chunk *chunk, u32 index)> process);
+};
@@ -0,0 +1,183 @@
+#include "journal.hpp"
+#include <cstring>
+
+#if defined(__unix__)
+#	include <unistd.h>
+#endif
+
+// u8 type, u8 reserved[3], s32 chunk_x, s32 chunk_y, u32 payload_size, u32 checksum
+static constexpr u32 record_header_size = 20;
+
+// FNV-1a, detects records torn by a crash
+static u32 checksum(u32 hash, const void *data, u32 size) {
+	auto *bytes = (const u8 *)data;
+	for(u32 i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static constexpr u32 checksum_init = 2166136261u;
+
+static bool readFile(const std::string &path, std::vector<u8> &out) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if(!f)
+		return false;
+
+	u8 chunk[65536];
+	size_t read;
+	while((read = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		out.insert(out.end(), chunk, chunk + read);
+
+	fclose(f);
+	return true;
+}
+
+Journal::~Journal() {
+	if(file) {
+		flush();
+		fclose(file);
+	}
+}
+
+bool Journal::open(const std::string &path, bool sync) {
+	LockGuard lock(mtx_file);
+	this->path = path;
+	this->path_old = path + ".old";
+	this->sync = sync;
+	remove(path_old.c_str());
+	file = fopen(path.c_str(), "wb");
+	opened = file != nullptr;
+	return opened;
+}
+
+void Journal::append(JournalRecordType type, Int2 chunk_pos, const void *payload_a, u32 size_a, const void *payload_b, u32 size_b) {
+	if(!opened)
+		return;
+
+	u8 header[record_header_size] = {};
+	u32 payload_size = size_a + size_b;
+	u32 sum = checksum(checksum(checksum_init, payload_a, size_a), payload_b, size_b);
+	header[0] = (u8)type;
+	memcpy(header + 4, &chunk_pos.x, sizeof(s32));
+	memcpy(header + 8, &chunk_pos.y, sizeof(s32));
+	memcpy(header + 12, &payload_size, sizeof(u32));
+	memcpy(header + 16, &sum, sizeof(u32));
+
+	LockGuard lock(mtx_buffer);
+	buffer.insert(buffer.end(), header, header + record_header_size);
+	buffer.insert(buffer.end(), (const u8 *)payload_a, (const u8 *)payload_a + size_a);
+	buffer.insert(buffer.end(), (const u8 *)payload_b, (const u8 *)payload_b + size_b);
+}
+
+void Journal::appendPixels(Int2 chunk_pos, const u8 *packed_pixels, u32 pixel_count) {
+	if(pixel_count)
+		append(JournalRecordType::pixels, chunk_pos, packed_pixels, pixel_count * 5, nullptr, 0);
+}
+
+void Journal::appendRect(Int2 chunk_pos, UInt2 pos, u32 width, u32 height, const u8 *compressed_rgb, u32 compressed_size) {
+	u16 rect[4] = {(u16)pos.x, (u16)pos.y, (u16)width, (u16)height};
+	append(JournalRecordType::rect, chunk_pos, rect, sizeof(rect), compressed_rgb, compressed_size);
+}
+
+void Journal::flush() {
+	LockGuard lock(mtx_file);
+	flush_nolock();
+}
+
+void Journal::flush_nolock() {
+	if(!file)
+		return;
+
+	std::vector<u8> to_write;
+	{
+		LockGuard lock(mtx_buffer);
+		to_write.swap(buffer);
+	}
+
+	if(to_write.empty())
+		return;
+
+	fwrite(to_write.data(), 1, to_write.size(), file);
+	fflush(file);
+
+#if defined(__unix__)
+	if(sync)
+		fsync(fileno(file));
+#endif
+}
+
+void Journal::beginCheckpoint() {
+	LockGuard lock(mtx_file);
+	if(!file)
+		return;
+
+	flush_nolock();
+	fclose(file);
+
+	FILE *old = fopen(path_old.c_str(), "rb");
+	if(old) {
+		// Previous checkpoint didn't finish, its records are still needed
+		fclose(old);
+		std::vector<u8> data;
+		readFile(path, data);
+		if((old = fopen(path_old.c_str(), "ab"))) {
+			fwrite(data.data(), 1, data.size(), old);
+			fclose(old);
+		}
+		remove(path.c_str());
+	} else {
+		rename(path.c_str(), path_old.c_str());
+	}
+
+	file = fopen(path.c_str(), "ab");
+	opened = file != nullptr;
+}
+
+void Journal::endCheckpoint() {
+	LockGuard lock(mtx_file);
+	if(!path_old.empty())
+		remove(path_old.c_str());
+}
+
+void Journal::removeFiles(const std::string &path) {
+	remove((path + ".old").c_str());
+	remove(path.c_str());
+}
+
+u32 Journal::replay(const std::string &path, const std::function<void(const JournalRecord &record)> &callback) {
+	u32 count = 0;
+
+	for(auto &segment_path : {path + ".old", path}) {
+		std::vector<u8> data;
+		if(!readFile(segment_path, data))
+			continue;
+
+		u32 offset = 0;
+		while(offset + record_header_size <= data.size()) {
+			auto *header = data.data() + offset;
+
+			JournalRecord record;
+			u32 sum;
+			record.type = (JournalRecordType)header[0];
+			memcpy(&record.chunk_pos.x, header + 4, sizeof(s32));
+			memcpy(&record.chunk_pos.y, header + 8, sizeof(s32));
+			memcpy(&record.payload_size, header + 12, sizeof(u32));
+			memcpy(&sum, header + 16, sizeof(u32));
+
+			if(record.payload_size > data.size() - offset - record_header_size)
+				break; // Incomplete
+
+			record.payload = header + record_header_size;
+			if(checksum(checksum_init, record.payload, record.payload_size) != sum)
+				break; // Corrupted
+
+			callback(record);
+			count++;
+			offset += record_header_size + record.payload_size;
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "util/mutex.hpp"
+#include "util/types.hpp"
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+enum struct JournalRecordType : u8 {
+	pixels = 1, // Packed pixels, 5 bytes each (u8 x, u8 y, u8 r, u8 g, u8 b)
+	rect = 2		// u16 x, y, width, height + LZ4 compressed rows
+};
+
+struct JournalRecord {
+	JournalRecordType type;
+	Int2 chunk_pos;
+	const u8 *payload;
+	u32 payload_size;
+};
+
+// Write-ahead log of chunk pixel operations. Records are buffered in memory by writers
+// and appended to rooms/<room>.journal by flush().
+//
+// Checkpoint: beginCheckpoint() moves the journal aside to <path>.old, every record in it
+// is covered once all chunks modified before that point are saved, endCheckpoint() then
+// removes it. Replay reads <path>.old followed by <path>, pixel operations are idempotent.
+struct Journal {
+private:
+	std::string path;
+	std::string path_old;
+	FILE *file = nullptr;
+	std::atomic<bool> opened = false;
+	bool sync = false;
+
+	Mutex mtx_buffer;
+	std::vector<u8> buffer;
+
+	Mutex mtx_file;
+
+	void append(JournalRecordType type, Int2 chunk_pos, const void *payload_a, u32 size_a, const void *payload_b, u32 size_b);
+	void flush_nolock();
+
+public:
+	~Journal();
+
+	// Starts a new, empty journal at path. Records of previous segments (and a torn tail after a crash)
+	// are discarded, they have to be replayed and saved first.
+	///@param sync fsync after every flush (survives power loss, not only process crash)
+	///@returns false if the file can't be opened
+	bool open(const std::string &path, bool sync);
+
+	bool isOpen() const {
+		return opened;
+	}
+
+	// Does nothing if journal is closed (e.g. while replaying)
+	void appendPixels(Int2 chunk_pos, const u8 *packed_pixels, u32 pixel_count);
+	void appendRect(Int2 chunk_pos, UInt2 pos, u32 width, u32 height, const u8 *compressed_rgb, u32 compressed_size);
+
+	// Writes buffered records to the file
+	void flush();
+
+	void beginCheckpoint();
+	void endCheckpoint();
+
+	///@returns number of records replayed from <path>.old and <path>. Reading stops at the first incomplete or corrupted record.
+	static u32 replay(const std::string &path, const std::function<void(const JournalRecord &record)> &callback);
+
+	// Removes journal segments at path (after they were replayed and saved)
+	static void removeFiles(const std::string &path);
+};
@@ -300,12 +300,13 @@ void Plugin::P::populateAPI() {
 	tab_server.set_function("mapSetPixel", [this](s32 global_x, s32 global_y, u8 r, u8 g, u8 b) {
 		Int2 global{global_x, global_y};
 		auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos(global);
-		auto *chunk = room->getChunkSystem()->getChunk(chunk_pos);
-		if(!chunk) return;
+		auto *chunk_system = room->getChunkSystem();
+		auto *chunk = chunk_system->pinChunk(chunk_pos);
 		ChunkPixel pixel;
 		pixel.pos = ChunkSystem::globalPixelPosToLocalPixelPos(global);
 		pixel.color = Color(r, g, b);
 		chunk->setPixelQueued(&pixel);
+		chunk_system->unpinChunk(chunk);
 	});
 
 	tab_server.set_function("mapBlitGray", [this](s32 posX, s32 posY, u32 width, u32 height, const std::string &data) {
@@ -313,24 +314,15 @@ void Plugin::P::populateAPI() {
 			throwf("mapBlitGray: Data size mismatch");
 		}
 
-		uniqdata<GlobalPixel> pixels(width * height);
-
-		Int2 global;
-		u32 offset = 0;
-		for(u32 y = 0; y < height; y++) {
-			for(u32 x = 0; x < width; x++) {
-				global.x = posX + x;
-				global.y = posY + y;
-
-				auto &pixel = pixels[offset];
-				pixel.pos = global;
-				u8 gray = data[offset];
-				pixel.color = Color(gray, gray, gray);
-				offset++;
-			}
+		std::vector<u8> rgb(width * height * 3);
+		for(u32 i = 0; i < width * height; i++) {
+			u8 gray = data[i];
+			rgb[i * 3 + 0] = gray;
+			rgb[i * 3 + 1] = gray;
+			rgb[i * 3 + 2] = gray;
 		}
 
-		room->setPixels_nolock(pixels.data(), pixels.size());
+		room->blitRect({posX, posY}, width, height, std::move(rgb));
 	});
 
 	tab_server.set_function("mapBlitRGB", [this](s32 posX, s32 posY, u32 width, u32 height, const std::string &data) {
@@ -338,25 +330,7 @@ void Plugin::P::populateAPI() {
 			throwf("mapBlitRGB: Data size mismatch");
 		}
 
-		uniqdata<GlobalPixel> pixels(width * height);
-
-		Int2 global;
-		u32 offset = 0;
-		for(u32 y = 0; y < height; y++) {
-			for(u32 x = 0; x < width; x++) {
-				global.x = posX + x;
-				global.y = posY + y;
-
-				auto &pixel = pixels[offset];
-				pixel.pos = global;
-				pixel.color.r = data[offset * 3 + 0];
-				pixel.color.g = data[offset * 3 + 1];
-				pixel.color.b = data[offset * 3 + 2];
-				offset++;
-			}
-		}
-
-		room->setPixels_nolock(pixels.data(), pixels.size());
+		room->blitRect({posX, posY}, width, height, std::vector<u8>(data.begin(), data.end()));
 	});
 }
 
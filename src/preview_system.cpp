@@ -12,23 +12,26 @@ PreviewSystemLayer::PreviewSystemLayer(PreviewSystem *system)
 		: system(system) {
 }
 
-void PreviewSystemLayer::addToQueue(Int2 coords) {
+void PreviewSystemLayer::addToQueue(Int2 coords, const ChunkTileMask &modified_tiles) {
 	// Check if already added to queue (reverse iterator)
 	for(auto it = update_queue.rbegin(); it != update_queue.rend(); it++) {
-		if(*it == coords)
+		if(it->coords == coords) {
+			it->modified_tiles |= modified_tiles;
 			return;
+		}
 	}
 
 	// Add to queue
-	update_queue.push_back(coords);
+	update_queue.push_back({coords, modified_tiles});
 }
 
 bool PreviewSystemLayer::processOneBlock() {
 	if(update_queue.empty())
 		return false;
 
-	auto position = update_queue.front();
+	auto block = update_queue.front();
 	update_queue.pop_front();
+	auto position = block.coords;
 
 	Int2 topleft = {position.x * 2, position.y * 2};
 	Int2 topright = {position.x * 2 + 1, position.y * 2};
@@ -36,6 +39,9 @@ bool PreviewSystemLayer::processOneBlock() {
 	Int2 bottomright = {position.x * 2 + 1, position.y * 2 + 1};
 
 	SharedVector<u8> compressed_topleft, compressed_topright, compressed_bottomleft, compressed_bottomright; // Compressed data
+	SharedVector<u8> compressed_previous;
+
+	bool partial = !block.modified_tiles.all();
 
 	// Lock database and fetch compressed data
 	auto &database = system->room->database;
@@ -52,6 +58,9 @@ bool PreviewSystemLayer::processOneBlock() {
 		compressed_bottomright = database.previewLoadData(bottomright, zoom - 1).data;
 	}
 
+	if(partial)
+		compressed_previous = database.previewLoadData(position, zoom).data;
+
 	// Unlock database
 	database.unlock();
 
@@ -67,75 +76,62 @@ bool PreviewSystemLayer::processOneBlock() {
 		return out;
 	};
 
-	auto data_topleft = decompress(compressed_topleft);
-	auto data_topright = decompress(compressed_topright);
-	auto data_bottomleft = decompress(compressed_bottomleft);
-	auto data_bottomright = decompress(compressed_bottomright);
+	SharedVector<u8> quadrants[4] = {
+			decompress(compressed_topleft),
+			decompress(compressed_topright),
+			decompress(compressed_bottomleft),
+			decompress(compressed_bottomright)};
 
-	// Fuse 2x2 chunks into one image
-	const auto image_size = chunk_size * 2;
-	uniqdata<u8> rgb(image_size * image_size /* 512² */ * 3 /*RGB*/);
-	memset(rgb.data(), 255, rgb.size());
+	// Start from the previous preview if only some tiles were modified
+	auto previous = decompress(compressed_previous);
+	if(!previous)
+		block.modified_tiles.set();
 
-	auto fillImage = [&](SharedVector<u8> &data, u8 x, u8 y) {
-		if(!data) return;
-
-		u32 offset_x = chunk_size * x;
-		u32 offset_y = chunk_size * y;
+	uniqdata<u8> downscaled(chunk_size * chunk_size * 3);
+	if(previous)
+		memcpy(downscaled.data(), previous->data(), downscaled.size());
+
+	// Downscale 2x2 chunks into one image, modified tiles only
+	const u32 pitch = chunk_size * 3;
+	const u32 half = chunk_size / 2;
+	for(u32 tile = 0; tile < ChunkImage::tile_count; tile++) {
+		if(!block.modified_tiles[tile])
+			continue;
 
-		const auto *rgb_in = data->data();
-		u32 pitch_in = chunk_size * 3;
-		u32 pitch_out = image_size * 3;
+		u32 start_x = (tile % ChunkImage::tiles_per_row) * ChunkTile::size;
+		u32 start_y = (tile / ChunkImage::tiles_per_row) * ChunkTile::size;
 
-		for(u32 local_y = 0; local_y < chunk_size; local_y++) {
-			for(u32 local_x = 0; local_x < chunk_size; local_x++) {
-				u32 target_x = offset_x + local_x;
-				u32 target_y = offset_y + local_y;
+		// Whole tile comes from a single quadrant
+		auto &quadrant = quadrants[(start_y / half) * 2 + start_x / half];
 
-				u32 offset_in = local_y * pitch_in + local_x * 3;
-				u32 offset_out = target_y * pitch_out + target_x * 3;
+		for(u32 y = start_y; y < start_y + ChunkTile::size; y++) {
+			auto *out = &downscaled[y * pitch + start_x * 3];
 
-				rgb[offset_out + 0] = rgb_in[offset_in + 0];
-				rgb[offset_out + 1] = rgb_in[offset_in + 1];
-				rgb[offset_out + 2] = rgb_in[offset_in + 2];
+			if(!quadrant) {
+				memset(out, 255, ChunkTile::size * 3); // White
+				continue;
 			}
-		}
-	};
 
-	// Blit images
-	fillImage(data_topleft, 0, 0);
-	fillImage(data_topright, 1, 0);
-	fillImage(data_bottomleft, 0, 1);
-	fillImage(data_bottomright, 1, 1);
-
-	// Downscale image
-	uniqdata<u8> downscaled(chunk_size * chunk_size * 3);
-	const u32 downscaled_pitch = chunk_size * 3;
-	const u32 image_pitch = image_size * 3;
-	for(u32 y = 0; y < chunk_size; y++) {
-		for(u32 x = 0; x < chunk_size; x++) {
-			u32 in_x = x * 2;
-			u32 in_y = y * 2;
-
-			auto *out = &downscaled[y * downscaled_pitch + x * 3];
-
-			auto performChannel = [&](u8 channel) {
-				out[channel] =
-						((u32)rgb[(in_y + 0) * image_pitch + (in_x + 0) * 3 + channel] +
-						 (u32)rgb[(in_y + 1) * image_pitch + (in_x + 0) * 3 + channel] +
-						 (u32)rgb[(in_y + 0) * image_pitch + (in_x + 1) * 3 + channel] +
-						 (u32)rgb[(in_y + 1) * image_pitch + (in_x + 1) * 3 + channel]) /
-						4;
-			};
-
-			performChannel(0); // Red
-			performChannel(1); // Green
-			performChannel(2); // Blue
+			u32 in_y = (y % half) * 2;
+			const auto *row0 = quadrant->data() + in_y * pitch;
+			const auto *row1 = row0 + pitch;
+
+			for(u32 x = start_x; x < start_x + ChunkTile::size; x++) {
+				u32 in_x = (x % half) * 2;
+				for(u32 channel = 0; channel < 3; channel++) {
+					out[channel] = ((u32)row0[in_x * 3 + channel] +
+													(u32)row1[in_x * 3 + channel] +
+													(u32)row0[(in_x + 1) * 3 + channel] +
+													(u32)row1[(in_x + 1) * 3 + channel]) /
+												 4;
+				}
+				out += 3;
+			}
 		}
 	}
 
 	// Compress downscaled image
-	auto compressed = compressLZ4(downscaled.data(), downscaled.size());
+	auto compressed = compressLZ4HC(downscaled.data(), downscaled.size(), system->room->settings.compression.storage_level);
 
 	// Write result, Lock database again
 	database.lock();
@@ -147,10 +143,10 @@ bool PreviewSystemLayer::processOneBlock() {
 		Int2 upper_pos;
 		upper_pos.x = position.x >= 0 ? position.x / 2 : (position.x - 1) / 2;
 		upper_pos.y = position.y >= 0 ? position.y / 2 : (position.y - 1) / 2;
-		upper_layer->addToQueue(upper_pos);
+		upper_layer->addToQueue(upper_pos, PreviewSystem::maskToUpper(position, block.modified_tiles));
 	}
 
-	system->room->log(LOG_PREVIEW_SYSTEM_LAYER, "Processed block at %dx%d, zoom %u (%u remaining)", position.x, position.y, zoom, (u32)update_queue.size());
+	system->room->log(LOG_PREVIEW_SYSTEM_LAYER, "Processed block at %dx%d, zoom %u, %u tiles (%u remaining)", position.x, position.y, zoom, (u32)block.modified_tiles.count(), (u32)update_queue.size());
 	return true;
 }
 
@@ -168,8 +164,8 @@ PreviewSystem::PreviewSystem(Room *room)
 
 void PreviewSystem::processUpdateQueueCache() {
 	LockGuard lock(mtx_access);
-	for(auto &pos : update_queue_cache) {
-		layers[0].addToQueue(pos);
+	for(auto &block : update_queue_cache) {
+		layers[0].addToQueue(block.coords, block.modified_tiles);
 	}
 	update_queue_cache.clear();
 }
@@ -192,8 +188,35 @@ void PreviewSystem::processEverything() {
 }
 
 void PreviewSystem::addToQueueFront(Int2 coords) {
+	ChunkTileMask all;
+	all.set();
+	addToQueueFront(coords, all);
+}
+
+void PreviewSystem::addToQueueFront(Int2 coords, const ChunkTileMask &modified_tiles) {
+	if(modified_tiles.none())
+		return;
+
 	LockGuard lock(mtx_access);
-	update_queue_cache.push_back(coords);
+	update_queue_cache.push_back({coords, modified_tiles});
+}
+
+ChunkTileMask PreviewSystem::maskToUpper(Int2 coords, const ChunkTileMask &modified_tiles) {
+	// Quadrant of the upper block covered by this chunk (or block)
+	u32 quadrant_x = coords.x & 1;
+	u32 quadrant_y = coords.y & 1;
+
+	const u32 half = ChunkImage::tiles_per_row / 2;
+
+	ChunkTileMask upper;
+	for(u32 tile = 0; tile < ChunkImage::tile_count; tile++) {
+		if(!modified_tiles[tile])
+			continue;
+		u32 x = quadrant_x * half + (tile % ChunkImage::tiles_per_row) / 2;
+		u32 y = quadrant_y * half + (tile / ChunkImage::tiles_per_row) / 2;
+		upper[y * ChunkImage::tiles_per_row + x] = true;
+	}
+	return upper;
 }
 
 PreviewSystem::~PreviewSystem() {
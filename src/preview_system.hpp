@@ -1,5 +1,6 @@
 #pragma once
 
+#include "chunk_image.hpp"
 #include "command.hpp"
 #include "util/event_queue.hpp"
 #include "util/mutex.hpp"
@@ -19,9 +20,14 @@ struct PreviewSystemLayer {
 	uint8_t zoom = 0;
 	PreviewSystemLayer *upper_layer = nullptr;
 
-	std::deque<Int2> update_queue;
+	struct QueuedBlock {
+		Int2 coords;
+		ChunkTileMask modified_tiles; // Tiles of this block which need to be regenerated
+	};
 
-	void addToQueue(Int2 coords);
+	std::deque<QueuedBlock> update_queue;
+
+	void addToQueue(Int2 coords, const ChunkTileMask &modified_tiles);
 
 	/// @returns true if processed something
 	bool processOneBlock();
@@ -41,8 +47,12 @@ struct PreviewSystem {
 		return index + 1;
 	}
 
-	std::vector<Int2> update_queue_cache;
+	std::vector<PreviewSystemLayer::QueuedBlock> update_queue_cache;
 	void addToQueueFront(Int2 coords);
+	void addToQueueFront(Int2 coords, const ChunkTileMask &modified_tiles);
+
+	/// Maps modified tiles of a chunk (or block) to modified tiles of the block one layer above
+	static ChunkTileMask maskToUpper(Int2 coords, const ChunkTileMask &modified_tiles);
 
 	SharedVector<u8> requestData(s32 preview_x, s32 preview_y, u8 zoom);
 
@@ -1,9 +1,11 @@
 #include "room.hpp"
 #include "chunk_system.hpp"
+#include "job_system.hpp"
 #include "plugin.hpp"
 #include "preview_system.hpp"
 #include "server.hpp"
 #include "src/chunk.hpp"
+#include "waiter.hpp"
 #include <math.h>
 #include <stdarg.h>
 
@@ -17,6 +19,7 @@ struct Room::P {
 	uniqptr<PreviewSystem> preview_system;
 	uniqptr<ChunkSystem> chunk_system;
 	uniqptr<PluginManager> plugin_manager;
+	uniqptr<JobSystem> job_system; // Freed first, jobs use chunks
 
 	Mutex mtx_brush_shapes;
 	BrushShapeMap brush_shapes_circle_filled;
@@ -31,6 +34,7 @@ Room::Room(Server *server, std::string_view name)
 
 	this->server = server;
 	p->name = name;
+	undo_budget = std::make_shared<UndoBudget>(settings.undo.room_budget_bytes);
 
 	// Init database
 	char db_path[256];
@@ -41,6 +45,10 @@ Room::Room(Server *server, std::string_view name)
 	p->chunk_system.create(this);
 	p->plugin_manager.create(this);
 	p->preview_system.create(this);
+	p->job_system.create(p->chunk_system.get(), settings.job_threads);
+
+	// Recover drawing not saved before the last shutdown
+	p->chunk_system->replayJournal();
 
 	if(settings.preview_system.process_all_at_start) {
 		database.lock();
@@ -195,22 +203,46 @@ BrushShape *Room::getBrushShape(u8 size, bool filled) {
 		// Brush shapes doesn't exist, generate it
 		auto &shape = (*map)[size];
 		shape.create();
-		shape->size = size;
-		shape->shape.resize(size * size);
+
+		// Filled size 2 is a 3x3 plus (5 pixels), the size 2 brush always drew it
+		bool plus = filled && size == 2;
+		u8 bitmap_size = plus ? 3 : size;
+
+		shape->size = bitmap_size;
+		shape->shape.resize(bitmap_size * bitmap_size);
 		auto *data = shape->shape.data();
 
-		// Generate circle
-		int centerX = size / 2;
-		int centerY = size / 2;
-		for(int y = 0; y < size; y++) {
-			for(int x = 0; x < size; x++) {
-				int diffX = centerX - x;
-				int diffY = centerY - y;
-				float distance = sqrtf(diffX * diffX + diffY * diffY);
-				if(filled)
-					data[y * size + x] = distance <= size / 2.0f;
-				else
-					data[y * size + x] = distance <= size / 2.0f && distance >= size / 2.0f - 2.0f;
+		int centerX = bitmap_size / 2;
+		int centerY = bitmap_size / 2;
+		if(plus) {
+			for(int y = 0; y < bitmap_size; y++)
+				for(int x = 0; x < bitmap_size; x++)
+					data[y * bitmap_size + x] = x == centerX || y == centerY;
+		} else {
+			// Generate circle
+			for(int y = 0; y < size; y++) {
+				for(int x = 0; x < size; x++) {
+					int diffX = centerX - x;
+					int diffY = centerY - y;
+					float distance = sqrtf(diffX * diffX + diffY * diffY);
+					if(filled)
+						data[y * size + x] = distance <= size / 2.0f;
+					else
+						data[y * size + x] = distance <= size / 2.0f && distance >= size / 2.0f - 2.0f;
+				}
+			}
+		}
+
+		// Runs of set pixels
+		for(int y = 0; y < bitmap_size; y++) {
+			for(int x = 0; x < bitmap_size; x++) {
+				if(!data[y * bitmap_size + x])
+					continue;
+
+				int start_x = x;
+				while(x + 1 < bitmap_size && data[y * bitmap_size + x + 1])
+					x++;
+				shape->spans.push_back({(s16)(y - centerY), (s16)(start_x - centerX), (s16)(x - centerX)});
 			}
 		}
 		return shape.get();
@@ -231,6 +263,10 @@ PluginManager *Room::getPluginManager() const {
 	return p->plugin_manager.get();
 }
 
+JobSystem *Room::getJobSystem() const {
+	return p->job_system.get();
+}
+
 void Room::freeRemovedSessions() {
 	LockGuard lock(mtx_sessions);
 
@@ -318,37 +354,41 @@ void Room::forEverySessionExcept(Session *except, std::function<void(Session *)>
 	}
 }
 
-void Room::setPixels_nolock(GlobalPixel *pixels, u32 count) {
-	Chunk *chunk_cache = nullptr;
-	std::vector<ChunkPixel> *data_cache = nullptr;
-	Int2 chunk_cache_pos = {INT32_MIN, INT32_MIN};
-
-	std::map<Chunk *, std::vector<ChunkPixel>> chunk_data;
-
-	for(u32 i = 0; i < count; i++) {
-		auto &pixel = pixels[i];
-		auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos(pixel.pos);
-
-		Chunk *chunk;
-		std::vector<ChunkPixel> *data;
-		if(chunk_pos == chunk_cache_pos) {
-			chunk = chunk_cache;
-			data = data_cache;
-		} else {
-			chunk = getChunkSystem()->getChunk(chunk_pos);
-			if(!chunk) continue;
-			data = &chunk_data[chunk];
-			chunk_cache = chunk;
-			data_cache = data;
-		}
-
-		ChunkPixel chunk_pixel;
-		chunk_pixel.pos = ChunkSystem::globalPixelPosToLocalPixelPos(pixel.pos);
-		chunk_pixel.color = pixel.color;
-		data->push_back(chunk_pixel);
-	}
+void Room::blitRect(Int2 pos, u32 width, u32 height, std::vector<u8> &&rgb) {
+	if(width == 0 || height == 0)
+		return;
 
-	for(auto &data : chunk_data) {
-		data.first->setPixels(data.second.data(), data.second.size());
-	}
-}
\ No newline at end of file
+	auto chunk_size = (s32)ChunkSystem::getChunkSize();
+	Int2 last = {pos.x + (s32)width - 1, pos.y + (s32)height - 1};
+	auto first_chunk = ChunkSystem::globalPixelPosToChunkPos(pos);
+	auto last_chunk = ChunkSystem::globalPixelPosToChunkPos(last);
+
+	std::vector<Int2> chunk_positions;
+	for(s32 chunk_y = first_chunk.y; chunk_y <= last_chunk.y; chunk_y++)
+		for(s32 chunk_x = first_chunk.x; chunk_x <= last_chunk.x; chunk_x++)
+			chunk_positions.push_back({chunk_x, chunk_y});
+
+	auto data = std::make_shared<std::vector<u8>>(std::move(rgb));
+
+	auto job = JobSystem::createChunkJob("Blitting", std::move(chunk_positions), [=](Job &job, Chunk *chunk, u32 index) {
+		// Part of the rectangle inside this chunk (global coordinates)
+		auto chunk_pos = chunk->getPosition();
+		s32 left = std::max(pos.x, chunk_pos.x * chunk_size);
+		s32 top = std::max(pos.y, chunk_pos.y * chunk_size);
+		s32 right = std::min(last.x + 1, (chunk_pos.x + 1) * chunk_size);
+		s32 bottom = std::min(last.y + 1, (chunk_pos.y + 1) * chunk_size);
+
+		auto *origin = data->data() + (size_t)(top - pos.y) * width * 3 + (size_t)(left - pos.x) * 3;
+		chunk->setRect(ChunkSystem::globalPixelPosToLocalPixelPos({left, top}), right - left, bottom - top, origin, width * 3);
+	});
+
+	// Plugin pixels written after this call have to land on top of the blit
+	Waiter waiter;
+	job->setOnFinish([&waiter](Job &) {
+		waiter.notify();
+	});
+
+	auto lock = waiter.getLock();
+	getJobSystem()->submit(job, this);
+	waiter.wait(lock);
+}
@@ -4,6 +4,7 @@
 #include "database.hpp"
 #include "session.hpp"
 #include "settings.hpp"
+#include "undo_history.hpp"
 #include "util/listener.hpp"
 #include "util/mutex.hpp"
 #include "util/smartptr.hpp"
@@ -11,18 +12,25 @@
 #include <map>
 #include <string_view>
 
+// Horizontal run of brush pixels, offsets from the brush center
+struct BrushSpan {
+	s16 y;
+	s16 start_x;
+	s16 end_x; // Inclusive
+};
+
 struct BrushShape {
 	u8 size; // Width and height
 	uniqdata<u8> shape;
+	std::vector<BrushSpan> spans; // Rows of the shape
 };
 
-struct GlobalPixel;
-
 struct Session;
 struct ChunkSystem;
 struct PreviewSystem;
 struct Settings;
 struct PluginManager;
+struct JobSystem;
 struct WsConnection;
 
 struct Room {
@@ -31,6 +39,7 @@ struct Room {
 	Server *server;
 	DatabaseConnector database;
 	Settings settings;
+	std::shared_ptr<UndoBudget> undo_budget; // Shared by undo histories of sessions
 
 private:
 	Mutex mtx_sessions;
@@ -54,12 +63,13 @@ public:
 	void broadcast(const Packet &packet, Session *except = nullptr);
 	void broadcast_nolock(const Packet &packet, Session *except = nullptr);
 
-	// Returns monochrome brush bitmap
+	// Returns monochrome brush bitmap, filled size 2 is a 3x3 plus
 	BrushShape *getBrushShape(u8 size, bool filled);
 
 	ChunkSystem *getChunkSystem() const;
 	PreviewSystem *getPreviewSystem() const;
 	PluginManager *getPluginManager() const;
+	JobSystem *getJobSystem() const;
 
 	Session *getSession_nolock(SessionID session_id);
 
@@ -68,7 +78,8 @@ public:
 	void removeSession(const std::shared_ptr<Session> &session);
 	size_t getSessionCount();
 
-	void setPixels_nolock(GlobalPixel *pixels, u32 count);
+	// Writes RGB rectangle, chunks are written in parallel by a room job. Returns once all chunks are written.
+	void blitRect(Int2 pos, u32 width, u32 height, std::vector<u8> &&rgb);
 
 private:
 	struct P;
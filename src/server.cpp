@@ -34,7 +34,10 @@ u64 getMillis() {
 	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - timer_start).count();
 }
 
-Server::Server() {
+Server::Server()
+		: settings(this) {
+	session_pool.create(std::max(1u, std::thread::hardware_concurrency()));
+
 	// Create "Rooms" directory
 	if(!std::filesystem::is_directory("rooms"))
 		std::filesystem::create_directory("rooms");
@@ -85,6 +88,15 @@ void Server::run(u16 port) {
 				room->tick();
 			}
 
+			// Session ticks, idle sessions stay parked until a message or packet arrives
+			{
+				LockGuard lock(mtx_sessions);
+				for(auto &session : sessions) {
+					if(session->wantsTicks())
+						session->wake();
+				}
+			}
+
 			// Check if rooms need to be removed
 			{
 				LockGuard lock(mtx_rooms_removal);
@@ -108,6 +120,24 @@ void Server::run(u16 port) {
 void Server::shutdown() {
 	log(LOG_SERVER, "======== SHUTTING DOWN SERVER ========");
 
+	// Let running session tasks finish before rooms are freed
+	{
+		LockGuard lock(mtx_sessions);
+		for(auto &session : sessions)
+			session->stopRunner();
+	}
+
+	while(true) {
+		LockGuard lock(mtx_sessions);
+		bool all_stopped = std::all_of(sessions.begin(), sessions.end(), [](auto &session) {
+			return session->hasStopped();
+		});
+		if(all_stopped)
+			break;
+		lock.free();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
 	// Free rooms
 	{
 		log(LOG_SERVER, "Freeing rooms");
@@ -146,6 +176,10 @@ Session *Server::getSession_nolock(WsConnection *connection) {
 	return it->second;
 }
 
+void Server::postSessionTask(std::function<void()> task) {
+	session_pool->post(std::move(task));
+}
+
 void Server::removeSession(WsConnection *connection) {
 	LockGuard lock(mtx_sessions);
 	removeSession_nolock(connection);
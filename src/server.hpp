@@ -1,9 +1,12 @@
 #pragma once
 
 #include "command.hpp"
+#include "settings.hpp"
 #include "util/event_queue.hpp"
 #include "util/listener.hpp"
 #include "util/mutex.hpp"
+#include "util/smartptr.hpp"
+#include "util/thread_pool.hpp"
 #include "ws_server.hpp"
 #include <functional>
 #include <map>
@@ -31,12 +34,17 @@ struct Server {
 	WsServer server; // Needs to be at the bottom to prevent data races
 
 private:
+	// Session tasks (messages, packets, ticks), sized to the core count. Outlives sessions.
+	uniqptr<ThreadPool> session_pool;
+
 	std::map<WsConnection *, Session *> session_map_conn; // For fast session lookup
 	std::vector<std::shared_ptr<Session>> sessions;
 	std::vector<uniqptr<Room>> rooms;
 	std::set<Room *> rooms_to_remove;
 
 public:
+	Settings settings; // Server-wide part of settings.json
+
 	Mutex mtx_sessions;
 	Mutex mtx_log;
 	Mutex mtx_rooms;
@@ -55,6 +63,8 @@ public:
 
 	void removeSession(WsConnection *connection);
 
+	void postSessionTask(std::function<void()> task);
+
 	Room *getOrCreateRoom(std::string_view room_name);
 	void markRoomForRemoval(Room *room);
 
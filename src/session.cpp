@@ -2,13 +2,16 @@
 #include "chunk.hpp"
 #include "chunk_system.hpp"
 #include "command.hpp"
+#include "floodfill.hpp"
+#include "job_system.hpp"
 #include "lib/ojson.hpp"
 #include "plugin.hpp"
 #include "preview_system.hpp"
 #include "room.hpp"
 #include "server.hpp"
-#include "src/waiter.hpp"
+#include "stroke_rasterizer.hpp"
 #include "util/binary_reader.hpp"
+#include "util/pixel_kernels.hpp"
 #include "util/timestep.hpp"
 #include "util/types.hpp"
 #include "ws_server.hpp"
@@ -22,22 +25,51 @@ static const char *LOG_SESSION = "Session";
 
 #define MIN_ZOOM 0.45
 
+// Max boundary width and height in chunks
+static constexpr s32 BOUNDARY_MAX_CHUNKS = 100;
+
+// Chunk offsets sorted by distance from the center, enough to cover a whole boundary from any of its cells
+static const std::vector<Int2> &getLoadOrderOffsets() {
+	static const std::vector<Int2> offsets = [] {
+		std::vector<Int2> out;
+		out.reserve((2 * BOUNDARY_MAX_CHUNKS + 1) * (2 * BOUNDARY_MAX_CHUNKS + 1));
+		for(s32 y = -BOUNDARY_MAX_CHUNKS; y <= BOUNDARY_MAX_CHUNKS; y++)
+			for(s32 x = -BOUNDARY_MAX_CHUNKS; x <= BOUNDARY_MAX_CHUNKS; x++)
+				out.push_back({x, y});
+
+		std::stable_sort(out.begin(), out.end(), [](Int2 a, Int2 b) {
+			return a.x * a.x + a.y * a.y < b.x * b.x + b.y * b.y;
+		});
+		return out;
+	}();
+	return offsets;
+}
+
 Session::Session(Server *server, SharedWsConnection &connection)
 		: server(server),
 			connection(connection),
 			cursor_pos({0, 0}),
 			cursor_pos_prev({0, 0}),
 			cursor_pos_sent({0, 0}),
+			message_queue(server->settings.session_queues.inbound_capacity),
+			packet_queue_control(server->settings.session_queues.control_capacity),
+			packet_queue(server->settings.session_queues.outbound_capacity),
+			outbound_max_bytes(server->settings.session_queues.outbound_max_bytes),
+			send_buffer_limit(server->settings.session_queues.send_buffer_limit),
+			outbound_overflow_kick(server->settings.session_queues.outbound_overflow_kick),
 			needs_boundary_test(false) {
-	thr_runner = std::thread(&Session::runner, this);
+	step_runner.reset();
+	step_runner.setRate(20);
+
+	queue.on_push = [this] {
+		wake();
+	};
 }
 
 Session::~Session() {
+	// Queued tasks hold a reference, no task can be running at this point
 	stopRunner();
 
-	if(thr_runner.joinable())
-		thr_runner.join();
-
 	while(!linked_chunks.empty()) {
 		fprintf(stderr, "Session linked chunks NOT empty\n");
 		abort();
@@ -46,11 +78,38 @@ Session::~Session() {
 	server->log(LOG_SESSION, "Session freed");
 }
 
-void Session::runner() {
-	step_runner.reset();
-	step_runner.setRate(20);
+void Session::wake() {
+	if(stopped)
+		return;
+
+	task_wake = true;
+	if(task_scheduled.exchange(true))
+		return; // Running task picks the work up
+
+	// Not owned by shared_ptr yet (or being destroyed)
+	auto self = weak_from_this().lock();
+	if(!self) {
+		task_scheduled = false;
+		return;
+	}
+
+	server->postSessionTask([self] {
+		self->runTask();
+	});
+}
+
+void Session::runTask() {
+	if(!perform_ticks) {
+		stopped = true;
+		stopping = false;
+		return; // Never scheduled again
+	}
+
+	task_wake = false;
 
-	while(perform_ticks) {
+	// Limited batch, other sessions on this worker get their turn
+	bool busy = false;
+	for(u32 i = 0; i < 64 && perform_ticks; i++) {
 		bool idle = true;
 		processed_input_message = false;
 
@@ -68,12 +127,24 @@ void Session::runner() {
 		if(queue.process(1))
 			idle = false;
 
+		busy = !idle;
 		if(idle)
-			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			break;
+	}
+
+	{
+		// Viewers with nothing to unload, load or send stay parked
+		auto cursor_sent = cursor_pos_sent.load();
+		auto cursor = cursor_pos.load();
+		wants_ticks = needs_boundary_test || linked_chunks_outside_boundary || outbound_pending ||
+									cursor_sent.x != cursor.x || cursor_sent.y != cursor.y;
 	}
 
-	stopped = true;
-	stopping = false;
+	task_scheduled = false;
+
+	// Stopped, more work left or woken while running
+	if(!perform_ticks || busy || task_wake)
+		wake();
 }
 
 bool Session::runner_tick() {
@@ -94,13 +165,14 @@ bool Session::runner_tick() {
 			std::vector<Int2> chunks_to_unload;
 			{
 				LockGuard lock(mtx_access);
-				for(size_t i = 0; i < linked_chunks.size(); i++) { // Do not use iterator there
-					auto &linked_chunk = linked_chunks[i];
-					auto pos = linked_chunk.chunk->getPosition();
+				linked_chunks_outside_boundary = false;
+				for(auto &[pos, linked_chunk] : linked_chunks) {
 					if(boundary.zoom <= MIN_ZOOM || pos.y < boundary.start_y || pos.y > boundary.end_y || pos.x < boundary.start_x || pos.x > boundary.end_x) {
 						linked_chunk.outside_boundary_duration++;
 						if(linked_chunk.outside_boundary_duration == 5 /* seconds */) {
 							chunks_to_unload.push_back(pos);
+						} else {
+							linked_chunks_outside_boundary = true; // Unload timer running
 						}
 					} else {
 						linked_chunk.outside_boundary_duration = 0;
@@ -114,161 +186,188 @@ bool Session::runner_tick() {
 			}
 		}
 
-		tick_tool_floodfill();
-
 		runner_performBoundaryTest();
 		return true;
 	}
 	return false;
 }
 
-void Session::tick_tool_floodfill() {
-	if(!floodfill.processing)
-		return;
-
-	char buf[64];
-	snprintf(buf, sizeof(buf), "Floodfilling... %u pixels processed", floodfill.processed_count);
-	sendPacketProcessingStatusText(buf);
+void Session::runJob(const std::shared_ptr<Job> &job) {
+	auto self = shared_from_this();
 
-	Color color;
+	job->setOnProgress([self](Job &job) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%s... %llu %s processed", job.getName().c_str(), (unsigned long long)job.getProgress(), job.getProgressUnit());
+		self->pushPacket(preparePacketProcessingStatusText(buf));
+	});
 
-	auto checkColor = [&](s32 x, s32 y) {
-		if(!getPixelGlobal_nolock({x, y}, &color)) {
-			return false;
-		}
+	job->setOnFinish([self](Job &job) {
+		self->pushPacket(preparePacketProcessingStatusText(job.isCancelled() ? "Cancelled" : ""));
 
-		if(color == tool.color) {
-			return false;
-		}
+		LockGuard lock(self->mtx_job);
+		if(self->active_job.get() == &job)
+			self->active_job.reset();
+	});
 
-		if(floodfill.to_replace != color) {
-			return false;
-		}
+	{
+		LockGuard lock(mtx_job);
+		active_job = job;
+	}
 
-		return true;
-	};
+	room->getJobSystem()->submit(job, this);
+}
 
-	LockGuard lock(mtx_access); // Required by getPixelGlobal_nolock
+bool Session::isJobActive() {
+	LockGuard lock(mtx_job);
+	return active_job != nullptr;
+}
 
-	auto time_start = getMillis();
-	u32 count = 0;
-	while(true) {
-		count++;
+void Session::cancelJob() {
+	LockGuard lock(mtx_job);
+	if(active_job)
+		active_job->cancel();
+}
 
-		if(floodfill.stack.empty()) break;
-		auto cell = floodfill.stack.top();
-		floodfill.stack.pop();
+void Session::startFloodfill(Int2 global_pos, Color to_replace) {
+	auto color = tool.color;
 
-		const u32 max_distance = 300;
-		if(abs(floodfill.start_x - cell.x) > max_distance || abs(floodfill.start_y - cell.y) > max_distance) {
-			continue;
-		}
+	// Snapshot of the click, the user can start another stroke before the fill finishes
+	u32 snapshot_id;
+	{
+		LockGuard lock(mtx_access);
+		snapshot_id = history.getSnapshotId();
+	}
 
-		setPixelQueued_nolock({cell.x, cell.y}, tool.color);
+	// Exploring is sequential, runs as a single item. Filled spans are written once per 100 ms.
+	auto job = std::make_shared<Job>("Floodfilling", "pixels", 1, [this, global_pos, to_replace, color, snapshot_id](Job &job, u32) {
+		Floodfill floodfill;
+		floodfill.begin(global_pos, to_replace, color, 1024 /* max distance */, [&](Int2 chunk_pos) -> Chunk * {
+			// Linked (visible) chunks only
+			return isChunkLinked(chunk_pos) ? job.pinChunk(chunk_pos) : nullptr;
+		});
 
-		if(checkColor(cell.x - 1, cell.y)) {
-			auto &left = floodfill.stack.emplace();
-			left.x = cell.x - 1;
-			left.y = cell.y;
+		std::vector<Int2> replaced_positions;
+		std::vector<Color> replaced_colors;
+		bool finished = false;
+		while(!finished && !job.isCancelled()) {
+			u32 filled_before = floodfill.getFilledCount();
+			finished = floodfill.process(100 /* ms */);
+			floodfill.commit([&](Int2 global_pos, Color previous) {
+				replaced_positions.push_back(global_pos);
+				replaced_colors.push_back(previous);
+			});
+			job.addProgress(floodfill.getFilledCount() - filled_before);
 		}
 
-		if(checkColor(cell.x + 1, cell.y)) {
-			auto &right = floodfill.stack.emplace();
-			right.x = cell.x + 1;
-			right.y = cell.y;
-		}
+		// Cancelled fill stays partially applied, undo reverts it
+		LockGuard lock(mtx_access);
+		history.addPixels(snapshot_id, replaced_positions.data(), replaced_colors.data(), replaced_positions.size());
+	});
 
-		if(checkColor(cell.x, cell.y - 1)) {
-			auto &top = floodfill.stack.emplace();
-			top.x = cell.x;
-			top.y = cell.y - 1;
-		}
+	runJob(job);
+}
 
-		if(checkColor(cell.x, cell.y + 1)) {
-			auto &bottom = floodfill.stack.emplace();
-			bottom.x = cell.x;
-			bottom.y = cell.y + 1;
-		}
+bool Session::runner_processMessageQueue() {
+	auto process = [&](std::shared_ptr<WsMessage> &msg) {
+		if(!perform_ticks)
+			return; // Kicked by a previous message
 
-		auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos({cell.x, cell.y});
-		floodfill.affected_chunks.emplace(chunk_pos);
+		if(mouse_down_pending) {
+			deferred_messages.push_back(std::move(msg));
+			return; // Processed after plugins answered
+		}
 
-		if(count % 5000 == 0) {
-			auto time = getMillis();
-			if(time_start + 100 < time || count > 100000) {
-				// Block thread for 100ms max
-				break;
-			}
+		if(msg->data.size() < sizeof(ClientCmd)) {
+			kickInvalidPacket();
+			return;
 		}
-	}
 
-	floodfill.processed_count += count;
+		// Command ID
+		u16 command_BE;
+		memcpy(&command_BE, msg->data.data(), sizeof(u16));
+		auto command = (ClientCmd)frombig16(command_BE);
 
-	if(floodfill.stack.empty()) {
-		// Trigger chunk "send" update for all attached sessions to display floodfill result instantly
-		for(auto &chunk_pos : floodfill.affected_chunks) {
-			auto *chunk = getChunkCached_nolock(chunk_pos);
-			if(!chunk)
-				return;
+		// Content without command (header)
+		std::string_view content(msg->data.data() + sizeof(ClientCmd), msg->data.size() - sizeof(ClientCmd));
 
-			chunk->flushQueuedPixels();
+		try {
+			parseCommand(command, content);
+		} catch(std::exception &e) {
+			server->log(LOG_SESSION, "Session parseCommand(): %s", e.what());
 		}
+	};
 
-		floodfill.reset();
+	if(mouse_down_pending)
+		return false; // Resumed by finishCursorDown()
 
-		sendPacketProcessingStatusText("");
+	// Received while waiting for mouse down
+	u32 count = 0;
+	while(!deferred_messages.empty() && !mouse_down_pending) {
+		auto msg = std::move(deferred_messages.front());
+		deferred_messages.pop_front();
+		process(msg);
+		count++;
 	}
+	if(count)
+		return true;
+
+	// Batch, ticks and packets in between keep the session responsive
+	return message_queue.drain(process, 32) > 0;
 }
 
-bool Session::runner_processMessageQueue() {
-	mtx_message_queue.lock();
-	if(message_queue.empty()) {
-		mtx_message_queue.unlock();
-		return false;
+bool Session::runner_processPacketQueue() {
+	if(outbound_overflowed.exchange(false)) {
+		auto stats = packet_queue.getStats();
+		server->log(LOG_SESSION, "Outbound queue overflow (%llu packets rejected, capacity %u, %u KiB queued)%s",
+								(unsigned long long)(stats.overflows + packet_queue_control.getStats().overflows), packet_queue.getCapacity(),
+								(u32)(outbound_bytes / 1024), outbound_overflow_kick ? ", kicking" : "");
+		if(outbound_overflow_kick) {
+			kick("Too slow to receive data");
+			return false;
+		}
 	}
 
-	// Grab next incoming message
-	auto msg = message_queue.front();
-	message_queue.pop();
-	mtx_message_queue.unlock();
+	// Dropped control packets (chat, status) are not resent
+	if(canvas_resync.exchange(false))
+		resyncCanvas();
 
-	if(msg->data.size() < sizeof(ClientCmd)) {
-		kickInvalidPacket();
-		return false;
-	}
+	auto collect = [&](Packet &packet) {
+		outbound_bytes -= packet->size();
+		outbound_batch.push_back(std::move(packet));
+	};
 
-	// Command ID
-	u16 command_BE;
-	memcpy(&command_BE, msg->data.data(), sizeof(u16));
-	auto command = (ClientCmd)frombig16(command_BE);
+	// Control packets are small and always sent
+	packet_queue_control.drain(collect, 256);
 
-	// Content without command (header)
-	std::string_view content(msg->data.data() + sizeof(ClientCmd), msg->data.size() - sizeof(ClientCmd));
+	// Others wait until the client reads what was sent already, superseded cursors are dropped meanwhile
+	bool backpressure = getConnection()->getBufferedAmount() > send_buffer_limit;
+	if(!backpressure) {
+		packet_queue.drain(collect, 256);
 
-	try {
-		parseCommand(command, content);
-	} catch(std::exception &e) {
-		server->log(LOG_SESSION, "Session parseCommand(): %s", e.what());
+		LockGuard lock(mtx_pending_cursors);
+		for(auto &[id, packet] : pending_cursors)
+			outbound_batch.push_back(std::move(packet));
+		pending_cursors.clear();
 	}
 
-	return true;
-}
-
-bool Session::runner_processPacketQueue() {
-	mtx_packet_queue.lock();
-	if(packet_queue.empty()) {
-		mtx_packet_queue.unlock();
-		return false;
+	if(backpressure) {
+		LockGuard lock(mtx_pending_cursors);
+		outbound_pending = packet_queue.size() || !pending_cursors.empty();
+	} else {
+		outbound_pending = false;
 	}
 
-	// Grab next packet
-	auto packet = packet_queue.front();
-	packet_queue.pop();
-	mtx_packet_queue.unlock();
+	if(outbound_batch.empty())
+		return false;
 
-	// Send packet to client
-	sendPacket(packet);
+	if(batch_frames) {
+		sendPacketsBatched(outbound_batch.data(), outbound_batch.size());
+	} else {
+		for(auto &packet : outbound_batch)
+			sendPacket(packet);
+	}
 
+	outbound_batch.clear();
 	return true;
 }
 
@@ -291,19 +390,70 @@ void Session::getMousePosition(s32 *mouseX, s32 *mouseY) {
 }
 
 void Session::pushIncomingMessage(std::shared_ptr<WsMessage> &msg) {
-	LockGuard lock(mtx_message_queue);
-	message_queue.push(msg);
-
 	// Rate limiting
-	auto queue_size = message_queue.size();
-	if(queue_size > 1000) {
+	if(!message_queue.tryPush(msg)) {
 		kick("Packet flood (or lag) detected");
+		return;
 	}
+	wake();
+}
+
+static ServerCmd getPacketCommand(const Packet &packet) {
+	u16 command_BE;
+	memcpy(&command_BE, packet->data(), sizeof(u16));
+	return (ServerCmd)frombig16(command_BE);
 }
 
 void Session::pushPacket(const Packet &packet) {
-	LockGuard lock(mtx_packet_queue);
-	packet_queue.push(packet);
+	auto command = getPacketCommand(packet);
+
+	if(command == ServerCmd::user_cursor_pos) {
+		// Keyed by user ID, replaces an unsent older position
+		u16 id;
+		memcpy(&id, packet->data() + sizeof(u16), sizeof(u16));
+		{
+			LockGuard lock(mtx_pending_cursors);
+			pending_cursors[id] = packet;
+		}
+		wake();
+		return;
+	}
+
+	bool canvas = command == ServerCmd::chunk_image || command == ServerCmd::chunk_pixel_pack || command == ServerCmd::chunk_rect_pack ||
+								command == ServerCmd::chunk_create || command == ServerCmd::chunk_remove;
+
+	// Memory limit, reported (and kicked if configured) by the session task
+	size_t size = packet->size();
+	if(outbound_bytes.fetch_add(size) + size > outbound_max_bytes || !(canvas ? packet_queue : packet_queue_control).tryPush(packet)) {
+		outbound_bytes -= size;
+		outbound_overflowed = true;
+
+		// Client misses canvas state, linked chunks are sent again from scratch (if not kicked)
+		if(canvas) {
+			if(command == ServerCmd::chunk_create)
+				dropped_chunk_creates++;
+			canvas_resync = true;
+		}
+	}
+	wake();
+}
+
+void Session::resyncCanvas() {
+	// Queued canvas packets are outdated by the resend, unacknowledged chunk creates are not counted anymore
+	u32 discarded_chunk_creates = 0;
+	packet_queue.drain([&](Packet &packet) {
+		outbound_bytes -= packet->size();
+		if(getPacketCommand(packet) == ServerCmd::chunk_create)
+			discarded_chunk_creates++;
+	});
+	chunks_sent -= discarded_chunk_creates + dropped_chunk_creates.exchange(0);
+
+	// Client ignores removal of chunks it never got, boundary test announces visible ones again
+	for(auto &chunk_pos : getLinkedChunkPositions())
+		room->getChunkSystem()->deannounceChunkForSession(this, chunk_pos);
+
+	load_plan.valid = false;
+	needs_boundary_test = true;
 }
 
 bool Session::hasStopped() {
@@ -318,20 +468,19 @@ void Session::stopRunner() {
 	if(stopping) return;
 	stopping = true;
 	perform_ticks = false;
+	cancelJob();
+	wake(); // Marks session as stopped
 }
 
 void Session::linkChunk(Chunk *chunk) {
 	LockGuard lock(mtx_access);
 
-	for(auto &cell : linked_chunks) {
-		if(cell.chunk == chunk)
-			return; // Already linked
-	}
+	auto [it, inserted] = linked_chunks.try_emplace(chunk->getPosition());
+	if(!inserted)
+		return; // Already linked
 
 	pushPacket(preparePacketChunkCreate(chunk->getPosition()));
-
-	auto &linked_chunk = linked_chunks.emplace_back();
-	linked_chunk.chunk = chunk;
+	it->second.chunk = chunk;
 }
 
 void Session::unlinkChunk(Chunk *chunk) {
@@ -340,16 +489,12 @@ void Session::unlinkChunk(Chunk *chunk) {
 	if(last_accessed_chunk_cache == chunk)
 		last_accessed_chunk_cache = nullptr;
 
-	for(auto it = linked_chunks.begin(); it != linked_chunks.end();) {
-		if(it->chunk == chunk) {
-			// Remove linked chunk
-			pushPacket(preparePacketChunkRemove(chunk->getPosition()));
-			it = linked_chunks.erase(it);
-			return;
-		} else {
-			it++;
-		}
-	}
+	auto it = linked_chunks.find(chunk->getPosition());
+	if(it == linked_chunks.end() || it->second.chunk != chunk)
+		return;
+
+	pushPacket(preparePacketChunkRemove(chunk->getPosition()));
+	linked_chunks.erase(it);
 }
 
 bool Session::isChunkLinked(Chunk *chunk) {
@@ -362,34 +507,42 @@ bool Session::isChunkLinked(Int2 chunk_pos) {
 	return isChunkLinked_nolock(chunk_pos);
 }
 
+std::vector<Int2> Session::getLinkedChunkPositions() {
+	LockGuard lock(mtx_access);
+	std::vector<Int2> positions;
+	positions.reserve(linked_chunks.size());
+	for(auto &[pos, linked_chunk] : linked_chunks)
+		positions.push_back(pos);
+	return positions;
+}
+
 bool Session::isChunkLinked_nolock(Chunk *chunk) {
-	for(auto &cell : linked_chunks) {
-		if(cell.chunk == chunk)
-			return true;
-	}
-	return false;
+	auto it = linked_chunks.find(chunk->getPosition());
+	return it != linked_chunks.end() && it->second.chunk == chunk;
 }
 
 bool Session::isChunkLinked_nolock(Int2 chunk_pos) {
-	for(auto &cell : linked_chunks) {
-		if(cell.chunk->getPosition() == chunk_pos)
-			return true;
-	}
-	return false;
+	return linked_chunks.count(chunk_pos) != 0;
 }
 
 Chunk *Session::getChunkCached_nolock(Int2 chunk_pos) {
-	if(last_accessed_chunk_cache && last_accessed_chunk_cache->getPosition() == chunk_pos)
-		return last_accessed_chunk_cache;
+	Chunk *chunk;
+	if(last_accessed_chunk_cache && last_accessed_chunk_cache->getPosition() == chunk_pos) {
+		chunk = last_accessed_chunk_cache;
+	} else {
+		auto it = linked_chunks.find(chunk_pos);
+		if(it == linked_chunks.end())
+			return nullptr;
 
-	for(auto &chunk : linked_chunks) {
-		if(chunk.chunk->getPosition() == chunk_pos) {
-			last_accessed_chunk_cache = chunk.chunk;
-			return chunk.chunk;
-		}
+		chunk = it->second.chunk;
+		last_accessed_chunk_cache = chunk;
 	}
 
-	return nullptr;
+	// Session pool workers never wait for the database. The client didn't get this chunk yet either.
+	if(chunk->isLoading())
+		return nullptr;
+
+	return chunk;
 }
 
 bool Session::getPixelGlobal_nolock(Int2 global_pos, Color *color) {
@@ -400,152 +553,62 @@ bool Session::getPixelGlobal_nolock(Int2 global_pos, Color *color) {
 
 	auto local_pos = ChunkSystem::globalPixelPosToLocalPixelPos(global_pos);
 	chunk->lock();
-	chunk->allocateImage_nolock();
 	chunk->getPixel_nolock(local_pos, color);
 	chunk->unlock();
 
 	return true;
 }
 
-void Session::setPixelsGlobal(GlobalPixel *pixels, size_t count, bool queued) {
-	LockGuard lock(mtx_access);
-	setPixelsGlobal_nolock(pixels, count, queued);
-}
-
-void Session::historyCreateSnapshot() {
-	if(history_cells.size() > 10)
-		history_cells.erase(history_cells.begin());
-
-	history_cells.emplace_back();
-}
-
 void Session::historyUndo_nolock() {
-	if(history_cells.empty())
+	std::vector<UndoHistory::ChunkDelta> deltas;
+	if(!history.popSnapshot(deltas))
 		return; // Nothing to undo
 
-	auto &back = history_cells.back();
-
-	char buf[64];
-	snprintf(buf, sizeof(buf), "Undoing %u pixels...", (u32)back.pixels.size());
-	sendPacketProcessingStatusText(buf);
-	setPixelsGlobal_nolock(back.pixels.data(), back.pixels.size(), true);
-	sendPacketProcessingStatusText("");
+	// Chunks are restored in parallel by a room job
+	std::vector<Int2> chunk_positions;
+	for(auto &delta : deltas)
+		chunk_positions.push_back(delta.chunk_pos);
 
-	history_cells.pop_back();
-}
+	auto shared_deltas = std::make_shared<std::vector<UndoHistory::ChunkDelta>>(std::move(deltas));
+	auto job = JobSystem::createChunkJob("Undoing", std::move(chunk_positions), [shared_deltas](Job &job, Chunk *chunk, u32 index) {
+		std::vector<ChunkPixel> pixels;
+		UndoHistory::decodeDelta((*shared_deltas)[index], pixels);
 
-void Session::historyAddPixel(GlobalPixel *pixel) {
-	if(history_cells.empty())
-		historyCreateSnapshot();
+		chunk->lock();
+		chunk->setPixelsCompact_nolock(pixels.data(), pixels.size());
+		chunk->unlock();
+	});
 
-	auto &back = history_cells.back();
-	back.pixels.push_back(*pixel);
+	runJob(job);
 }
 
-void Session::setPixelsGlobal_nolock(GlobalPixel *pixels, size_t count, bool queued) {
-	struct ChunkCacheCell {
-		Int2 chunk_pos;
-		Chunk *chunk;
-		std::vector<ChunkPixel> queued_pixels;
-		std::vector<Int2> queued_global_positions;
-	};
-
-	// Chunk "cache"
-	// Visible and affected chunks by player
-	std::vector<ChunkCacheCell> affected_chunks;
-
-	auto fetchCell = [&](Int2 chunk_pos) -> ChunkCacheCell * {
-		for(auto &cell : affected_chunks) {
-			if(cell.chunk_pos == chunk_pos) {
-				return &cell;
-			}
-		}
-
-		return nullptr;
-	};
-
-	auto cacheNewChunk = [&](Int2 chunk_pos) {
-		auto *chunk = getChunkCached_nolock(chunk_pos);
-		if(!chunk) return;
-		affected_chunks.push_back({Int2(chunk_pos), chunk});
-	};
-
-	// Generate affected chunks list
-	for(size_t i = 0; i < count; i++) {
-		auto &pixel = pixels[i];
-		auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos(pixel.pos);
-		if(fetchCell(chunk_pos) == nullptr) {
-			cacheNewChunk(chunk_pos);
-		}
-	}
-
-	// Send pixels to chunks
-	for(size_t i = 0; i < count; i++) {
-		auto &pixel = pixels[i];
-		auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos(pixel.pos);
-		auto *cell = fetchCell(chunk_pos);
-		if(!cell)
-			continue; // Skip pixel
-
-		auto &queued_pixel = cell->queued_pixels.emplace_back();
-		auto &queued_global_pos = cell->queued_global_positions.emplace_back();
-		queued_global_pos = pixel.pos;
-		queued_pixel.pos = ChunkSystem::globalPixelPosToLocalPixelPos(pixel.pos);
-		queued_pixel.color = pixel.color;
-	}
-
-	for(auto &cell : affected_chunks) {
-		if(cell.queued_pixels.empty())
-			continue;
-
-		cell.chunk->lock();
-		cell.chunk->allocateImage_nolock();
-
-		for(u32 i = 0; i < cell.queued_pixels.size(); i++) {
-			auto &queued_pixel = cell.queued_pixels[i];
-			auto &queued_global_pos = cell.queued_global_positions[i];
+void Session::setChunkPixels_nolock(Chunk *chunk, ChunkPixel *pixels, u32 count) {
+	if(count == 0)
+		return;
 
-			GlobalPixel gpixel;
-			gpixel.pos = queued_global_pos;
-			cell.chunk->getPixel_nolock(queued_pixel.pos, &gpixel.color);
+	std::vector<Color> colors(count);
+	std::vector<Color> previous_colors(count);
+	std::vector<Color> captured_colors(count);
+	std::vector<u32> changed_indices(count);
 
-			if(gpixel.color != queued_pixel.color) {
-				historyAddPixel(&gpixel);
-			}
-		}
+	for(u32 i = 0; i < count; i++)
+		colors[i] = pixels[i].color;
 
-		if(queued) {
-			cell.chunk->setPixelsQueued_nolock(cell.queued_pixels.data(), cell.queued_pixels.size());
-			cell.chunk->flushQueuedPixels_nolock();
-		} else {
-			cell.chunk->setPixels_nolock(cell.queued_pixels.data(), cell.queued_pixels.size());
-		}
-
-		cell.chunk->unlock();
-	}
-}
-
-void Session::setPixelQueued_nolock(Int2 global_pos, Color color) {
-	auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos(global_pos);
-	auto *chunk = getChunkCached_nolock(chunk_pos);
-	if(!chunk)
-		return;
+	chunk->lock();
 
-	auto local_pos = ChunkSystem::globalPixelPosToLocalPixelPos(global_pos);
+	// Capture previous colors of changed pixels for undo history
+	chunk->getPixels_nolock(pixels, count, previous_colors.data());
+	u32 changed_count = rgbCaptureChanged((const u8 *)previous_colors.data(), (const u8 *)colors.data(), count,
+																				changed_indices.data(), (u8 *)captured_colors.data());
 
-	GlobalPixel global_pixel;
-	global_pixel.pos = global_pos;
-	chunk->lock();
-	chunk->allocateImage_nolock();
-	chunk->getPixel_nolock(local_pos, &global_pixel.color);
-	if(global_pixel.color != color) {
-		historyAddPixel(&global_pixel);
+	auto chunk_origin = chunk->getPosition();
+	auto chunk_size = (s32)ChunkSystem::getChunkSize();
+	for(u32 i = 0; i < changed_count; i++) {
+		auto &pos = pixels[changed_indices[i]].pos;
+		history.addPixel({chunk_origin.x * chunk_size + (s32)pos.x, chunk_origin.y * chunk_size + (s32)pos.y}, captured_colors[i]);
 	}
 
-	ChunkPixel pixel;
-	pixel.pos = local_pos;
-	pixel.color = color;
-	chunk->setPixelQueued_nolock(&pixel);
+	chunk->setPixels_nolock(pixels, count);
 	chunk->unlock();
 }
 
@@ -567,12 +630,48 @@ void Session::sendPacket(const Packet &packet) {
 	}
 }
 
+void Session::sendPacketsBatched(const Packet *packets, u32 count) {
+	static constexpr size_t frame_budget = 64 * 1024;
+
+	u32 first = 0;
+	while(first < count) {
+		// Packets fitting into a single frame
+		u32 end = first;
+		size_t frame_size = sizeof(ServerCmd);
+		while(end < count && frame_size + sizeof(u32) + packets[end]->size() <= frame_budget) {
+			frame_size += sizeof(u32) + packets[end]->size();
+			end++;
+		}
+
+		if(end - first <= 1) {
+			// Nothing to coalesce (or too big for the budget)
+			sendPacket(packets[first]);
+			first++;
+			continue;
+		}
+
+		auto frame = std::make_shared<uniqdata<u8>>();
+		frame->resize(frame_size);
+		u8 *out = frame->data();
+
+		u16 command_BE = tobig16((u16)ServerCmd::batch);
+		memcpy(out, &command_BE, sizeof(u16));
+		out += sizeof(u16);
+
+		for(u32 i = first; i < end; i++) {
+			u32 size_BE = tobig32((u32)packets[i]->size());
+			memcpy(out, &size_BE, sizeof(u32));
+			memcpy(out + sizeof(u32), packets[i]->data(), packets[i]->size());
+			out += sizeof(u32) + packets[i]->size();
+		}
+
+		sendPacket(frame);
+		first = end;
+	}
+}
+
 void Session::sendPacketProcessingStatusText(std::string_view text) {
-	Datasize data_text(text.data(), text.size());
-	Datasize *datasizes[] = {
-			&data_text,
-			nullptr};
-	sendPacket(preparePacket(ServerCmd::processing_status_text, datasizes));
+	sendPacket(preparePacketProcessingStatusText(text));
 }
 
 void Session::close() {
@@ -700,6 +799,11 @@ void Session::parseCommandAnnounce(const std::string_view data) {
 		if(!reader.read(nickname.data(), nickname_size))
 			break;
 
+		// Optional, not sent by older clients
+		u8 capabilities = 0;
+		if(reader.read(&capabilities, sizeof(u8)))
+			batch_frames = capabilities & (u8)ClientCapability::batch_frames;
+
 		// Filter out nickname characters
 		for(auto &ch : nickname) {
 			switch(ch) {
@@ -726,6 +830,12 @@ void Session::parseCommandAnnounce(const std::string_view data) {
 		kick("Failed to load room");
 	}
 
+	{
+		LockGuard lock(mtx_access);
+		auto &undo = room->settings.undo;
+		history.init(room->undo_budget, undo.session_budget_bytes, undo.max_snapshots);
+	}
+
 	// ID is set for this client at this line
 	if(!room->addSession(shared_from_this())) {
 		server->log(LOG_SESSION, "Failed to add session");
@@ -798,67 +908,28 @@ void Session::updateCursor() {
 				break;
 			}
 
-			auto *brush_shape_outline = room->getBrushShape(tool.size, false);
-			auto *brush_shape_filled = room->getBrushShape(tool.size, true);
-
-			std::vector<GlobalPixel> pixels;
-			pixels.reserve(256);
-
-			auto addPixel = [&](s32 x, s32 y, Color color) {
-				auto &cell = pixels.emplace_back();
-				cell.pos.x = x;
-				cell.pos.y = y;
-				cell.color = color;
-			};
+			auto *brush_shape = room->getBrushShape(tool.size, true);
 
-			// Draw line
-			for(u32 i = 0; i <= iters; i++) {
-				float alpha = i / float(iters);
+			LockGuard lock(mtx_access);
+			if(!stroke)
+				stroke.create();
 
-				// Lerp
-				s32 x = roundf(lerp(alpha, cursor_prev.x, cursor_pos.x));
-				s32 y = roundf(lerp(alpha, cursor_prev.y, cursor_pos.y));
-
-				switch(tool.size) {
-					case 1: {
-						addPixel(x, y, tool.color);
-						break;
-					}
-					case 2: {
-						addPixel(x, y, tool.color);
-						addPixel(x - 1, y, tool.color);
-						addPixel(x + 1, y, tool.color);
-						addPixel(x, y - 1, tool.color);
-						addPixel(x, y + 1, tool.color);
-						break;
-					}
-					default: {
-						auto *shape = i == 0 ? brush_shape_filled : brush_shape_outline;
-						auto *data = shape->shape.data();
-						for(int yy = 0; yy < shape->size; yy++) {
-							for(int xx = 0; xx < shape->size; xx++) {
-								if(data[yy * shape->size + xx]) {
-									addPixel(x + xx - tool.size / 2, y + yy - tool.size / 2, tool.color);
-								}
-							}
-						}
-						break;
-					}
-				}
-			}
-
-			setPixelsGlobal(pixels.data(), pixels.size(), false);
+			// Every covered pixel is written once, overlapping stamps are merged
+			stroke->rasterizeSegment(cursor_prev, cursor_pos, *brush_shape, tool.color);
+			stroke->forEachChunk([&](Int2 chunk_pos, std::vector<ChunkPixel> &pixels) {
+				if(auto *chunk = getChunkCached_nolock(chunk_pos))
+					setChunkPixels_nolock(chunk, pixels.data(), pixels.size());
+			});
+			stroke->clear();
 			break;
 		}
 		case ToolType::floodfill: {
-			// Allow single click only, prevent running if already running floodfill
-			if(floodfill.processing || !cursor_just_clicked)
+			// Allow single click only, prevent running if already running floodfill or undo
+			if(isJobActive() || !cursor_just_clicked)
 				break;
 
 			auto cursor_pos = this->cursor_pos.load();
 
-			floodfill.reset();
-			floodfill.processing = true;
 			Color color;
 			if(!isChunkLinked(ChunkSystem::globalPixelPosToChunkPos(cursor_pos)))
 				break;
@@ -866,14 +937,8 @@ void Session::updateCursor() {
 			if(!getPixelGlobal_nolock(cursor_pos, &color))
 				break;
 
-			if(tool.color != color) {
-				floodfill.to_replace = color;
-				floodfill.start_x = cursor_pos.x;
-				floodfill.start_y = cursor_pos.y;
-				auto &cell = floodfill.stack.emplace();
-				cell.x = cursor_pos.x;
-				cell.y = cursor_pos.y;
-			}
+			if(tool.color != color)
+				startFloodfill(cursor_pos, color);
 			break;
 		}
 	}
@@ -904,19 +969,26 @@ void Session::parseCommandCursorPos(const std::string_view data) {
 }
 
 void Session::parseCommandCursorDown(const std::string_view data) {
-	Waiter waiter;
-	auto lk = waiter.getLock();
-	bool cancelled = false;
-
-	// Wait for all plugins for accepting MouseDown event (blocking!)
-	room->queue.push([&, this] {
-		auto *plugman = room->getPluginManager();
-		if(plugman->passUserMouseDown(getID().value()))
-			cancelled = true;
-		waiter.notify();
+	// Plugins can cancel mouse down on the room thread. Following messages wait for the answer
+	// in deferred_messages, no worker thread is blocked in the meantime.
+	mouse_down_pending = true;
+
+	std::weak_ptr<Session> weak = weak_from_this();
+	room->queue.push([weak] {
+		auto self = weak.lock();
+		if(!self)
+			return;
+
+		bool cancelled = self->room->getPluginManager()->passUserMouseDown(self->getID().value());
+		auto *session = self.get();
+		session->queue.push([session, cancelled] {
+			session->finishCursorDown(cancelled);
+		});
 	});
+}
 
-	waiter.wait(lk);
+void Session::finishCursorDown(bool cancelled) {
+	mouse_down_pending = false;
 
 	if(cancelled) // Cancel mouseDown event
 		return;
@@ -924,7 +996,10 @@ void Session::parseCommandCursorDown(const std::string_view data) {
 	cursor_down = true;
 	cursor_just_clicked = true;
 	this->cursor_pos_prev = this->cursor_pos.load();
-	historyCreateSnapshot();
+	{
+		LockGuard lock(mtx_access);
+		history.createSnapshot();
+	}
 	updateCursor();
 }
 
@@ -934,6 +1009,12 @@ void Session::parseCommandCursorUp(const std::string_view data) {
 }
 
 void Session::parseCommandUndo(const std::string_view data) {
+	// Stop running fill or undo first, the next undo reverts what it already did
+	if(isJobActive()) {
+		cancelJob();
+		return;
+	}
+
 	LockGuard lock(mtx_access);
 	historyUndo_nolock();
 }
@@ -1009,8 +1090,8 @@ void Session::parseCommandBoundary(const std::string_view data) {
 		end_x = start_x;
 
 	// Chunk limit
-	end_x = std::min(end_x, start_x + 100);
-	end_y = std::min(end_y, start_y + 100);
+	end_x = std::min(end_x, start_x + BOUNDARY_MAX_CHUNKS);
+	end_y = std::min(end_y, start_y + BOUNDARY_MAX_CHUNKS);
 
 	boundary.start_x = start_x;
 	boundary.start_y = start_y;
@@ -1018,7 +1099,9 @@ void Session::parseCommandBoundary(const std::string_view data) {
 	boundary.end_y = end_y;
 	boundary.zoom = zoom;
 
+	load_plan.valid = false;
 	needs_boundary_test = true;
+	linked_chunks_outside_boundary = true; // Checked by the next unload pass
 }
 
 void Session::parseCommandChunksReceived(const std::string_view data) {
@@ -1079,61 +1162,69 @@ void Session::runner_performBoundaryTest() {
 
 	needs_boundary_test = false;
 
-	std::vector<Int2> chunks_to_load;
-
-	if(boundary.zoom > MIN_ZOOM) {
-		LockGuard lock(mtx_access);
+	// Nothing visible
+	if(boundary.zoom <= MIN_ZOOM || boundary.end_x <= boundary.start_x || boundary.end_y <= boundary.start_y)
+		return;
 
-		// Check which chunks aren't announced for this session
-		for(s32 y = boundary.start_y; y < boundary.end_y; y++) {
-			for(s32 x = boundary.start_x; x < boundary.end_x; x++) {
-				if(!isChunkLinked_nolock({x, y})) {
-					chunks_to_load.push_back({x, y});
-				}
-			}
-		}
+	// Chunk under the cursor, clamped to the boundary (circular loading)
+	auto cursor_pos = this->cursor_pos.load();
+	Int2 center = {
+			std::clamp((s32)floorf((float)cursor_pos.x / ChunkSystem::getChunkSize()), boundary.start_x, boundary.end_x - 1),
+			std::clamp((s32)floorf((float)cursor_pos.y / ChunkSystem::getChunkSize()), boundary.start_y, boundary.end_y - 1)};
+
+	if(!load_plan.valid || !(load_plan.center == center)) {
+		load_plan.center = center;
+		load_plan.next_offset = 0;
+		load_plan.valid = true;
 	}
 
-	// No chunks to load
-	if(chunks_to_load.empty()) return;
-
 	s64 in_queue = (s64)chunks_sent - (s64)chunks_received;
 	s32 to_send = 40 - in_queue; // Max 40 queued chunks
+	if(to_send <= 0) {
+		needs_boundary_test = true; // Wait for client
+		return;
+	}
 
-	auto cursor_pos = this->cursor_pos.load();
+	// Farthest boundary corner, offsets past it can't be inside
+	s32 far_x = std::max(center.x - boundary.start_x, boundary.end_x - 1 - center.x);
+	s32 far_y = std::max(center.y - boundary.start_y, boundary.end_y - 1 - center.y);
+	s32 max_distance_sq = far_x * far_x + far_y * far_y;
 
-	for(s32 iterations = 0; iterations < to_send; iterations++) {
-		if(chunks_to_load.empty())
-			break;
+	auto &offsets = getLoadOrderOffsets();
+	std::vector<Int2> chunks_to_load;
+	bool finished = true;
+	{
+		LockGuard lock(mtx_access);
 
-		// Get closest chunk (circular loading)
-		float center_x = (float)cursor_pos.x / ChunkSystem::getChunkSize();
-		float center_y = (float)cursor_pos.y / ChunkSystem::getChunkSize();
-		Int2 closest_position;
-		float closest_distance = __FLT_MAX__;
-		for(auto &ch : chunks_to_load) {
-			float distance = VecDistance({center_x, center_y}, {(float)ch.x, (float)ch.y});
-			if(distance < closest_distance) {
-				closest_distance = distance;
-				closest_position = ch;
-			}
-		}
+		// Check which chunks aren't announced for this session
+		while(load_plan.next_offset < offsets.size()) {
+			auto offset = offsets[load_plan.next_offset];
+			if(offset.x * offset.x + offset.y * offset.y > max_distance_sq)
+				break;
 
-		// Remove closest chunks_to_load cell (mark as loaded)
-		for(auto it = chunks_to_load.begin(); it != chunks_to_load.end();) {
-			if(*it == closest_position) {
-				it = chunks_to_load.erase(it);
-			} else {
-				it++;
+			if((s32)chunks_to_load.size() == to_send) {
+				finished = false;
+				break;
 			}
+
+			load_plan.next_offset++;
+
+			Int2 pos = {center.x + offset.x, center.y + offset.y};
+			if(pos.x < boundary.start_x || pos.x >= boundary.end_x || pos.y < boundary.start_y || pos.y >= boundary.end_y)
+				continue;
+
+			if(!isChunkLinked_nolock(pos))
+				chunks_to_load.push_back(pos);
 		}
+	}
 
-		// Announce chunk
+	// Announce chunks
+	for(auto &chunk_pos : chunks_to_load) {
 		chunks_sent++;
-		room->getChunkSystem()->announceChunkForSession(this, closest_position);
+		room->getChunkSystem()->announceChunkForSession(this, chunk_pos);
 	}
 
-	needs_boundary_test = !chunks_to_load.empty();
+	needs_boundary_test = !finished;
 }
 
 bool Session::isValid() {
@@ -4,13 +4,16 @@
 #include "command.hpp"
 #include "src/waiter.hpp"
 #include "util/event_queue.hpp"
+#include "util/mpsc_ring.hpp"
 #include "util/mutex.hpp"
 #include "util/optional.hpp"
 #include "util/smartptr.hpp"
 #include "util/timestep.hpp"
 #include "util/types.hpp"
+#include "undo_history.hpp"
 #include "ws_server.hpp"
 #include <atomic>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -19,32 +22,27 @@
 #include <string>
 #include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 struct Server;
 struct Chunk;
 struct WsMessage;
 struct Room;
+struct Job;
+struct ChunkPixel;
+struct StrokeRasterizer;
 
 struct LinkedChunk {
 	Chunk *chunk;
 	u32 outside_boundary_duration = 0;
 };
 
-struct FloodfillCell {
-	s32 x;
-	s32 y;
-};
-
 struct GlobalPixel {
 	Int2 pos;
 	Color color;
 };
 
-struct HistoryCell {
-	std::vector<GlobalPixel> pixels;
-};
-
 struct Session : std::enable_shared_from_this<Session> {
 private:
 	std::atomic<bool> valid = false;
@@ -74,43 +72,65 @@ private:
 		float zoom;
 	} boundary;
 
+	// Center-out chunk loading, walks offsets sorted by distance and resumes where the previous
+	// boundary test stopped. Restarted when the boundary or the center chunk changes.
+	struct {
+		Int2 center;
+		u32 next_offset = 0;
+		bool valid = false;
+	} load_plan;
+
 	// Number of chunks received by client
 	u32 chunks_received = 0;
 	// Number of chunks sent by server
 	u32 chunks_sent = 0;
 
 	Timestep step_runner;
-	std::thread thr_runner;
-
-	// Queues
-	Mutex mtx_message_queue;
-	std::queue<std::shared_ptr<WsMessage>> message_queue;
 
-	Mutex mtx_packet_queue;
-	std::queue<Packet> packet_queue;
+	// Session work runs as tasks on the server session pool, at most one at a time
+	std::atomic<bool> task_scheduled = false; // Queued or running
+	std::atomic<bool> task_wake = false;			// New work arrived since the task started
+	std::atomic<bool> wants_ticks = false;		// Has timed work (cursor, chunk boundary), woken by server tick
+
+	// Queues, any thread pushes, session task drains
+	MpscRing<std::shared_ptr<WsMessage>> message_queue;
+
+	// Mouse down waits for plugins on the room thread, messages received meanwhile are kept in order
+	bool mouse_down_pending = false;
+	std::deque<std::shared_ptr<WsMessage>> deferred_messages;
+
+	// Outbound priority classes, sent in this order:
+	// control (chat, users, status), canvas (chunk create/remove, images, pixels; order matters) and cursors
+	MpscRing<Packet> packet_queue_control;
+	MpscRing<Packet> packet_queue;
+	Mutex mtx_pending_cursors;
+	std::unordered_map<u16, Packet> pending_cursors; // Latest position per user, older ones are superseded
+
+	std::atomic<size_t> outbound_bytes = 0; // Queued in rings
+	size_t outbound_max_bytes;
+	size_t send_buffer_limit;
+	std::atomic<bool> outbound_overflow_kick;
+	std::atomic<bool> outbound_overflowed = false;
+	std::atomic<bool> canvas_resync = false; // Canvas packet dropped, client is out of sync
+	std::atomic<u32> dropped_chunk_creates = 0;
+	std::atomic<bool> outbound_pending = false; // Held back by backpressure, retried on tick
+
+	// Client accepts multiple packets in a single websocket frame (ServerCmd::batch)
+	bool batch_frames = false;
+	std::vector<Packet> outbound_batch;
 
 	Mutex mtx_access;
-	std::vector<LinkedChunk> linked_chunks;
+	std::unordered_map<Int2, LinkedChunk, Int2Hash> linked_chunks; // Keyed by chunk position
 
-	std::vector<HistoryCell> history_cells;
+	UndoHistory history;
+	uniqptr<StrokeRasterizer> stroke; // Brush coverage, reused between cursor moves
 
-	struct {
-		Color to_replace;
-		std::stack<FloodfillCell> stack;
-		std::set<Int2> affected_chunks;
-		bool processing = false;
-		s32 start_x;
-		s32 start_y;
-		u32 processed_count = 0;
-		void reset() {
-			processing = false;
-			affected_chunks = {};
-			stack = {};
-			processed_count = 0;
-		}
-	} floodfill;
+	// Room job started by this session (floodfill, undo), one at a time
+	Mutex mtx_job;
+	std::shared_ptr<Job> active_job;
 
 	bool needs_boundary_test;
+	bool linked_chunks_outside_boundary = false; // Some linked chunk waits for unloading, needs ticks
 
 	EventQueue queue;
 
@@ -142,12 +162,20 @@ public:
 
 	/// Non-blocking
 	void stopRunner();
-	void stopRunnerWait();
+
+	// Schedules a session task if none is queued or running (new message, packet or tick)
+	void wake();
+
+	// Idle sessions are not woken by the server tick
+	bool wantsTicks() const {
+		return wants_ticks;
+	}
 
 	void linkChunk(Chunk *chunk);
 	void unlinkChunk(Chunk *chunk);
 	bool isChunkLinked(Chunk *chunk);
 	bool isChunkLinked(Int2 chunk_pos);
+	std::vector<Int2> getLinkedChunkPositions();
 
 	Room *getRoom() const;
 	inline bool hasRoom() const { return getRoom() != nullptr; }
@@ -155,6 +183,8 @@ public:
 private:
 	// Send packet with exception handler
 	void sendPacket(const Packet &packet);
+	// Coalesces packets into batch frames up to a size budget (client has to support it)
+	void sendPacketsBatched(const Packet *packets, u32 count);
 	bool isChunkLinked_nolock(Chunk *chunk);
 	bool isChunkLinked_nolock(Int2 chunk_pos);
 	void close();
@@ -167,13 +197,19 @@ private:
 
 	bool processed_input_message = false;
 
-	void runner();
+	// Processes a bounded batch of work, reschedules itself if there is more
+	void runTask();
 	bool runner_tick();
 
-	void tick_tool_floodfill();
+	void runJob(const std::shared_ptr<Job> &job);
+	bool isJobActive();
+	void cancelJob();
+	void startFloodfill(Int2 global_pos, Color to_replace);
 
 	bool runner_processMessageQueue();
 	bool runner_processPacketQueue();
+	// Unlinks all chunks after a dropped canvas packet, the boundary test links and sends them again
+	void resyncCanvas();
 	void runner_performBoundaryTest();
 
 	void parseCommand(ClientCmd cmd, const std::string_view data);
@@ -181,6 +217,7 @@ private:
 	void parseCommandMessage(const std::string_view data);
 	void parseCommandCursorPos(const std::string_view data);
 	void parseCommandCursorDown(const std::string_view data);
+	void finishCursorDown(bool cancelled);
 	void parseCommandCursorUp(const std::string_view data);
 	void parseCommandUndo(const std::string_view data);
 	void parseCommandToolSize(const std::string_view data);
@@ -195,14 +232,12 @@ private:
 
 	void updateCursor();
 
+	// Null if not linked or still loading
 	Chunk *getChunkCached_nolock(Int2 chunk_pos);
 	bool getPixelGlobal_nolock(Int2 global_pos, Color *color);
-	void setPixelQueued_nolock(Int2 global_pos, Color color);
 
-	void setPixelsGlobal_nolock(GlobalPixel *pixels, size_t count, bool queued);
-	void setPixelsGlobal(GlobalPixel *pixels, size_t count, bool queued);
+	// Pixels of a single chunk (local positions), previous colors are added to undo history
+	void setChunkPixels_nolock(Chunk *chunk, ChunkPixel *pixels, u32 count);
 
-	void historyCreateSnapshot();
 	void historyUndo_nolock();
-	void historyAddPixel(GlobalPixel *pixel);
 };
\ No newline at end of file
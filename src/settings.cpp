@@ -5,6 +5,7 @@
 #include "util/logs.hpp"
 #include "util/smartptr.hpp"
 #include "util/types.hpp"
+#include <algorithm>
 #include <fstream>
 
 void Settings::load() {
@@ -45,6 +46,22 @@ void Settings::loadParams(ojson::Object &obj) {
 		this->autosave_interval = json->getInt();
 	}
 
+	if(auto *json = obj.getNumber("flush_interval")) {
+		this->flush_interval = std::max((s32)json->getInt(), 0);
+	}
+
+	if(auto *json = obj.getNumber("chunk_loader_threads")) {
+		this->chunk_loader_threads = std::max((s32)json->getInt(), 1);
+	}
+
+	if(auto *json = obj.getNumber("autosave_threads")) {
+		this->autosave_threads = std::max((s32)json->getInt(), 0);
+	}
+
+	if(auto *json = obj.getNumber("job_threads")) {
+		this->job_threads = std::max((s32)json->getInt(), 1);
+	}
+
 	if(auto *arr = obj.getArray("plugin_list")) {
 		arr->foreach([&](ojson::Element *e) {
 			auto *str = e->castString();
@@ -59,6 +76,66 @@ void Settings::loadParams(ojson::Object &obj) {
 		if(auto *json = preview_system->getBoolean("process_all_at_start"))
 			ps.process_all_at_start = json->get();
 	}
+
+	if(auto *compression = obj.getObject("compression")) {
+		auto &c = this->compression;
+
+		if(auto *json = compression->getNumber("fast_acceleration"))
+			c.fast_acceleration = std::max(1, (s32)json->getInt());
+
+		if(auto *json = compression->getNumber("storage_level"))
+			c.storage_level = std::clamp((s32)json->getInt(), 1, 12);
+	}
+
+	if(auto *session_queues = obj.getObject("session_queues")) {
+		auto &q = this->session_queues;
+
+		if(auto *json = session_queues->getNumber("inbound_capacity"))
+			q.inbound_capacity = std::clamp((s32)json->getInt(), 16, 1 << 20);
+
+		if(auto *json = session_queues->getNumber("outbound_capacity"))
+			q.outbound_capacity = std::clamp((s32)json->getInt(), 16, 1 << 20);
+
+		if(auto *json = session_queues->getNumber("control_capacity"))
+			q.control_capacity = std::clamp((s32)json->getInt(), 16, 1 << 20);
+
+		if(auto *json = session_queues->getNumber("outbound_max_mib"))
+			q.outbound_max_bytes = (size_t)std::max((s32)json->getInt(), 1) * 1024 * 1024;
+
+		if(auto *json = session_queues->getNumber("send_buffer_kib"))
+			q.send_buffer_limit = (size_t)std::max((s32)json->getInt(), 16) * 1024;
+
+		if(auto *json = session_queues->getString("outbound_overflow")) {
+			if(json->get() == "kick")
+				q.outbound_overflow_kick = true;
+			else if(json->get() == "drop")
+				q.outbound_overflow_kick = false;
+		}
+	}
+
+	if(auto *journal = obj.getObject("journal")) {
+		if(auto *json = journal->getBoolean("enabled"))
+			this->journal.enabled = json->get();
+
+		if(auto *json = journal->getBoolean("sync"))
+			this->journal.sync = json->get();
+	}
+
+	if(auto *image_cache = obj.getObject("image_cache")) {
+		if(auto *json = image_cache->getNumber("budget_mib"))
+			this->image_cache.budget_bytes = (size_t)std::max((s32)json->getInt(), 0) * 1024 * 1024;
+	}
+
+	if(auto *undo = obj.getObject("undo")) {
+		if(auto *json = undo->getNumber("max_snapshots"))
+			this->undo.max_snapshots = std::max((s32)json->getInt(), 1);
+
+		if(auto *json = undo->getNumber("session_budget_mib"))
+			this->undo.session_budget_bytes = (size_t)std::max((s32)json->getInt(), 0) * 1024 * 1024;
+
+		if(auto *json = undo->getNumber("room_budget_mib"))
+			this->undo.room_budget_bytes = (size_t)std::max((s32)json->getInt(), 0) * 1024 * 1024;
+	}
 }
 
 Settings::Settings(Room *room)
@@ -70,5 +147,14 @@ Settings::Settings(Room *room)
 	}
 }
 
+Settings::Settings(Server *server)
+		: server(server) {
+	try {
+		load();
+	} catch(std::exception &e) {
+		server->log("Settings", "Failed to load settings file: %s", e.what());
+	}
+}
+
 Settings::~Settings() {
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <vector>
 
 struct Room;
+struct Server;
 
 namespace ojson {
 	class Object;
@@ -13,16 +14,52 @@ private:
 	void load();
 	void loadParams(ojson::Object &obj);
 
-	Room *room;
+	Room *room = nullptr;
+	Server *server = nullptr;
 
 public:
 	std::vector<std::string> plugin_list;
 	u32 autosave_interval = 30000; // in milliseconds
+	u32 flush_interval = 50;			 // Max delay of queued pixels (floodfill, plugins) in milliseconds
+	u32 chunk_loader_threads = 2;	 // Threads loading chunks from the database
+	u32 autosave_threads = 2;			 // Threads compressing chunks for storage (in addition to the runner thread)
+	u32 job_threads = 2;					 // Threads running long edit operations (floodfill, undo, plugin blits)
 
 	struct {
 		bool process_all_at_start = false;
 	} preview_system;
 
+	struct {
+		s32 fast_acceleration = 1; // LZ4 acceleration for packets sent immediately (chunk images, pixel packs)
+		s32 storage_level = 12;		 // LZ4HC level for data written to the database (1-12)
+	} compression;
+
+	// Per-session lock-free queues, allocated when the session connects
+	struct {
+		u32 inbound_capacity = 1024;	// Client messages not processed yet, client is kicked on overflow (flood)
+		u32 outbound_capacity = 4096; // Canvas packets not sent yet (chunk images, pixels)
+		u32 control_capacity = 256;		// Chat, user and status packets not sent yet
+		size_t outbound_max_bytes = 16 * 1024 * 1024; // Queued packet memory limit per session
+		size_t send_buffer_limit = 512 * 1024;	// Canvas and cursor packets wait while the connection buffers more than this
+		bool outbound_overflow_kick = true; // Disconnect session if outbound queues are full, otherwise drop the packet
+	} session_queues;
+
+	struct {
+		bool enabled = true; // Append pixel operations to rooms/<room>.journal, replayed after a crash
+		bool sync = false;	 // fsync journal on every flush, also survives power loss
+	} journal;
+
+	struct {
+		size_t budget_bytes = 256 * 1024 * 1024; // Memory for decompressed chunk images, least recently used are freed first
+	} image_cache;
+
+	struct {
+		u32 max_snapshots = 16;													// Undo steps per session
+		size_t session_budget_bytes = 16 * 1024 * 1024; // Oldest snapshots are dropped first
+		size_t room_budget_bytes = 256 * 1024 * 1024;		// Shared by all sessions in the room
+	} undo;
+
 	Settings(Room *room);
+	Settings(Server *server); // Server-wide settings (session queues)
 	~Settings();
 };
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "stroke_rasterizer.hpp"
+#include "chunk_system.hpp"
+#include "util/timestep.hpp"
+#include <math.h>
+
+StrokeRasterizer::ChunkCoverage *StrokeRasterizer::getCoverage(Int2 chunk_pos) {
+	if(last_coverage && last_coverage->chunk_pos == chunk_pos)
+		return last_coverage;
+
+	// Few chunks per segment, linear search
+	for(u32 i = 0; i < used_count; i++) {
+		if(coverages[i].chunk_pos == chunk_pos) {
+			last_coverage = &coverages[i];
+			return last_coverage;
+		}
+	}
+
+	if(used_count == coverages.size())
+		coverages.emplace_back();
+
+	auto &coverage = coverages[used_count++];
+	coverage.chunk_pos = chunk_pos;
+	if(!coverage.mask)
+		coverage.mask.create();
+
+	last_coverage = &coverage;
+	return last_coverage;
+}
+
+void StrokeRasterizer::addSpan(s32 start_x, s32 end_x, s32 y, Color color) {
+	auto chunk_size = (s32)ChunkSystem::getChunkSize();
+
+	// Split into chunk rows
+	for(s32 x = start_x; x <= end_x;) {
+		auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos({x, y});
+		s32 chunk_end_x = (chunk_pos.x + 1) * chunk_size - 1;
+		s32 segment_end = std::min(end_x, chunk_end_x);
+
+		auto *coverage = getCoverage(chunk_pos);
+		auto local = ChunkSystem::globalPixelPosToLocalPixelPos({x, y});
+		auto &mask = *coverage->mask;
+		u32 row = local.y * ChunkImage::size;
+		for(u32 local_x = local.x; local_x <= local.x + (u32)(segment_end - x); local_x++) {
+			if(mask[row + local_x])
+				continue; // Covered by a previous stamp
+
+			mask[row + local_x] = true;
+			auto &pixel = coverage->pixels.emplace_back();
+			pixel.pos = {local_x, local.y};
+			pixel.color = color;
+		}
+
+		x = segment_end + 1;
+	}
+}
+
+void StrokeRasterizer::rasterizeSegment(Int2 from, Int2 to, const BrushShape &brush, Color color) {
+	u32 steps = VecDistance({from.x, from.y}, {to.x, to.y});
+	if(steps == 0)
+		steps = 1;
+
+	for(u32 i = 0; i <= steps; i++) {
+		float alpha = i / float(steps);
+
+		// Lerp
+		s32 x = roundf(lerp(alpha, from.x, to.x));
+		s32 y = roundf(lerp(alpha, from.y, to.y));
+
+		for(auto &span : brush.spans)
+			addSpan(x + span.start_x, x + span.end_x, y + span.y, color);
+	}
+}
+
+void StrokeRasterizer::forEachChunk(const std::function<void(Int2 chunk_pos, std::vector<ChunkPixel> &pixels)> &callback) {
+	for(u32 i = 0; i < used_count; i++)
+		callback(coverages[i].chunk_pos, coverages[i].pixels);
+}
+
+void StrokeRasterizer::clear() {
+	for(u32 i = 0; i < used_count; i++) {
+		auto &coverage = coverages[i];
+		coverage.mask->reset();
+		coverage.pixels.clear();
+	}
+	used_count = 0;
+	last_coverage = nullptr;
+}
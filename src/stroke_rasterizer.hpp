@@ -0,0 +1,40 @@
+#pragma once
+
+#include "chunk.hpp"
+#include "chunk_image.hpp"
+#include "color.hpp"
+#include "room.hpp"
+#include "util/smartptr.hpp"
+#include "util/types.hpp"
+#include <bitset>
+#include <functional>
+#include <vector>
+
+// Rasterizes brush strokes into per-chunk coverage masks. Overlapping brush stamps cover a pixel
+// only once, every covered pixel is emitted a single time per segment.
+struct StrokeRasterizer {
+private:
+	struct ChunkCoverage {
+		Int2 chunk_pos;
+		uniqptr<std::bitset<ChunkImage::size * ChunkImage::size>> mask;
+		std::vector<ChunkPixel> pixels;
+	};
+
+	// Reused between segments, only the first used_count entries are valid
+	std::vector<ChunkCoverage> coverages;
+	u32 used_count = 0;
+	ChunkCoverage *last_coverage = nullptr;
+
+	ChunkCoverage *getCoverage(Int2 chunk_pos);
+	void addSpan(s32 start_x, s32 end_x, s32 y, Color color);
+
+public:
+	/// Sweeps brush from "from" to "to" (one stamp per pixel of distance)
+	void rasterizeSegment(Int2 from, Int2 to, const BrushShape &brush, Color color);
+
+	// Called once for every chunk covered by the segment
+	void forEachChunk(const std::function<void(Int2 chunk_pos, std::vector<ChunkPixel> &pixels)> &callback);
+
+	// Clears coverage, keeps allocated masks
+	void clear();
+};
@@ -0,0 +1,284 @@
+#include "undo_history.hpp"
+#include "chunk.hpp"
+#include "chunk_system.hpp"
+#include <algorithm>
+
+typedef std::bitset<ChunkImage::size * ChunkImage::size> RecordedMask;
+
+UndoHistory::~UndoHistory() {
+	clear();
+	if(room_budget)
+		room_budget->history_count--;
+}
+
+void UndoHistory::init(std::shared_ptr<UndoBudget> room_budget, size_t session_budget_bytes, u32 max_snapshots) {
+	clear();
+	if(this->room_budget)
+		this->room_budget->history_count--;
+	this->room_budget = std::move(room_budget);
+	if(this->room_budget)
+		this->room_budget->history_count++;
+	this->session_budget_bytes = session_budget_bytes;
+	ring.clear();
+	ring.resize(std::max(max_snapshots, 1u));
+	ring_start = 0;
+	ring_count = 0;
+}
+
+u32 UndoHistory::createSnapshot() {
+	seal();
+	open_dropped = false;
+	open_id = ++last_id;
+	enforceBudget();
+	return open_id;
+}
+
+void UndoHistory::addPixels(u32 snapshot_id, const Int2 *global_positions, const Color *previous, u32 count) {
+	if(snapshot_id == open_id) {
+		for(u32 i = 0; i < count; i++)
+			addPixel(global_positions[i], previous[i]);
+		return;
+	}
+
+	// Newer snapshot was started in the meantime, record pixels as a separate snapshot in place of the old one
+	auto saved_chunk_indices = std::move(open_chunk_indices);
+	auto saved_chunks = std::move(open_chunks);
+	auto saved_bytes = open_bytes;
+	auto saved_dropped = open_dropped;
+	open_chunk_indices.clear();
+	open_chunks.clear();
+	open_bytes = 0;
+	open_dropped = false;
+
+	for(u32 i = 0; i < count; i++)
+		addPixel(global_positions[i], previous[i]);
+
+	if(!open_dropped && !open_chunks.empty() && !ring.empty()) {
+		Snapshot snapshot;
+		encodeOpen(snapshot);
+		snapshot.id = snapshot_id;
+		dropOpen();
+		insertSnapshot(std::move(snapshot));
+	} else {
+		dropOpen();
+	}
+
+	open_chunk_indices = std::move(saved_chunk_indices);
+	open_chunks = std::move(saved_chunks);
+	open_bytes = saved_bytes;
+	open_dropped = saved_dropped;
+	reportUsage();
+}
+
+void UndoHistory::addPixel(Int2 global_pos, Color previous) {
+	if(open_dropped)
+		return;
+
+	auto chunk_pos = ChunkSystem::globalPixelPosToChunkPos(global_pos);
+	auto [it, inserted] = open_chunk_indices.try_emplace(chunk_pos, open_chunks.size());
+	if(inserted) {
+		auto &open_chunk = open_chunks.emplace_back();
+		open_chunk.chunk_pos = chunk_pos;
+		open_chunk.recorded.create();
+		open_bytes += sizeof(OpenChunk) + sizeof(RecordedMask);
+		used_bytes += sizeof(OpenChunk) + sizeof(RecordedMask);
+	}
+
+	auto &open_chunk = open_chunks[it->second];
+	auto local_pos = ChunkSystem::globalPixelPosToLocalPixelPos(global_pos);
+	u16 index = local_pos.y * ChunkImage::size + local_pos.x;
+	if(open_chunk.recorded->test(index))
+		return; // Already recorded, the oldest color is restored
+
+	open_chunk.recorded->set(index);
+	open_chunk.indices.push_back(index);
+	open_chunk.colors.push_back(previous);
+	open_bytes += sizeof(u16) + sizeof(Color);
+	used_bytes += sizeof(u16) + sizeof(Color);
+
+	if(inserted || ++unreported_pixels >= 4096)
+		enforceBudget();
+}
+
+void UndoHistory::seal() {
+	if(open_chunks.empty() || ring.empty()) {
+		dropOpen();
+		open_dropped = false;
+		return;
+	}
+
+	Snapshot snapshot;
+	encodeOpen(snapshot);
+	snapshot.id = open_id;
+	open_id = ++last_id; // Pixels added from now on are not part of it
+
+	dropOpen();
+	open_dropped = false;
+	insertSnapshot(std::move(snapshot));
+}
+
+void UndoHistory::encodeOpen(Snapshot &snapshot) {
+	std::vector<u32> order;
+	std::vector<u8> raw;
+
+	for(auto &open_chunk : open_chunks) {
+		u32 count = open_chunk.indices.size();
+
+		// Sorted by position, neighbouring pixels of a stroke compress well
+		order.resize(count);
+		for(u32 i = 0; i < count; i++)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [&](u32 a, u32 b) {
+			return open_chunk.indices[a] < open_chunk.indices[b];
+		});
+
+		raw.resize(count * (sizeof(u16) + sizeof(Color)));
+		auto *out_indices = raw.data();
+		auto *out_colors = raw.data() + count * sizeof(u16);
+		u16 previous_index = 0;
+		for(u32 i = 0; i < count; i++) {
+			u16 index = open_chunk.indices[order[i]];
+			u16 delta = index - previous_index;
+			previous_index = index;
+			out_indices[i * 2 + 0] = delta & 0xFF;
+			out_indices[i * 2 + 1] = delta >> 8;
+
+			auto &color = open_chunk.colors[order[i]];
+			out_colors[i * 3 + 0] = color.r;
+			out_colors[i * 3 + 1] = color.g;
+			out_colors[i * 3 + 2] = color.b;
+		}
+
+		auto &delta = snapshot.chunks.emplace_back();
+		delta.chunk_pos = open_chunk.chunk_pos;
+		delta.pixel_count = count;
+		delta.compressed = compressLZ4(raw.data(), raw.size(), 1);
+		snapshot.bytes += sizeof(ChunkDelta) + delta.compressed->size();
+	}
+}
+
+void UndoHistory::insertSnapshot(Snapshot &&snapshot) {
+	auto at = [&](u32 i) -> Snapshot & {
+		return ring[(ring_start + i) % ring.size()];
+	};
+
+	if(ring_count == ring.size()) {
+		if(snapshot.id < at(0).id)
+			return; // Older than everything kept
+		evictOldest();
+	}
+
+	// Ordered by id, usually appended
+	u32 position = ring_count;
+	while(position > 0 && at(position - 1).id > snapshot.id) {
+		at(position) = std::move(at(position - 1));
+		position--;
+	}
+
+	used_bytes += snapshot.bytes;
+	at(position) = std::move(snapshot);
+	ring_count++;
+}
+
+void UndoHistory::evictOldest() {
+	auto &oldest = ring[ring_start];
+	used_bytes -= oldest.bytes;
+	oldest = {};
+	ring_start = (ring_start + 1) % ring.size();
+	ring_count--;
+}
+
+void UndoHistory::dropOpen() {
+	used_bytes -= open_bytes;
+	open_bytes = 0;
+	open_chunks.clear();
+	open_chunk_indices.clear();
+	open_dropped = true;
+}
+
+size_t UndoHistory::getBudgetLimit() const {
+	if(!room_budget || room_budget->used_bytes <= room_budget->budget_bytes)
+		return session_budget_bytes;
+
+	// Room is full, sessions holding more than their share give memory back first
+	u32 history_count = std::max(room_budget->history_count.load(), 1u);
+	return std::min(session_budget_bytes, room_budget->budget_bytes / history_count);
+}
+
+void UndoHistory::enforceBudget() {
+	reportUsage();
+
+	auto overBudget = [&] {
+		return used_bytes > getBudgetLimit();
+	};
+
+	// Oldest snapshots go first
+	while(ring_count && overBudget()) {
+		evictOldest();
+		reportUsage();
+	}
+
+	// Current snapshot alone is too big, stop recording it
+	if(overBudget()) {
+		dropOpen();
+		reportUsage();
+	}
+}
+
+void UndoHistory::reportUsage() {
+	if(room_budget) {
+		if(used_bytes > reported_bytes)
+			room_budget->used_bytes += used_bytes - reported_bytes;
+		else
+			room_budget->used_bytes -= reported_bytes - used_bytes;
+	}
+	reported_bytes = used_bytes;
+	unreported_pixels = 0;
+}
+
+bool UndoHistory::popSnapshot(std::vector<ChunkDelta> &out) {
+	seal();
+
+	if(ring_count == 0)
+		return false;
+
+	auto &newest = ring[(ring_start + ring_count - 1) % ring.size()];
+	out = std::move(newest.chunks);
+	used_bytes -= newest.bytes;
+	newest = {};
+	ring_count--;
+
+	reportUsage();
+	return true;
+}
+
+void UndoHistory::clear() {
+	dropOpen();
+	open_dropped = false;
+	for(auto &snapshot : ring)
+		snapshot = {};
+	ring_start = 0;
+	ring_count = 0;
+	used_bytes = 0;
+	reportUsage();
+}
+
+void UndoHistory::decodeDelta(const ChunkDelta &delta, std::vector<ChunkPixel> &out) {
+	u32 count = delta.pixel_count;
+	std::vector<u8> raw(count * (sizeof(u16) + sizeof(Color)));
+	out.clear();
+	if(decompressLZ4(delta.compressed->data(), delta.compressed->size(), raw.data(), raw.size()) != (int)raw.size())
+		return; // Corrupted
+
+	auto *in_indices = raw.data();
+	auto *in_colors = raw.data() + count * sizeof(u16);
+	out.resize(count);
+
+	u16 index = 0;
+	for(u32 i = 0; i < count; i++) {
+		index += in_indices[i * 2 + 0] | (in_indices[i * 2 + 1] << 8);
+		auto &pixel = out[i];
+		pixel.pos = {(u32)(index % ChunkImage::size), (u32)(index / ChunkImage::size)};
+		pixel.color = Color(in_colors[i * 3 + 0], in_colors[i * 3 + 1], in_colors[i * 3 + 2]);
+	}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "chunk_image.hpp"
+#include "color.hpp"
+#include "command.hpp"
+#include "util/smartptr.hpp"
+#include "util/types.hpp"
+#include <atomic>
+#include <bitset>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct ChunkPixel;
+
+// Memory shared by undo histories of all sessions in a room
+struct UndoBudget {
+	std::atomic<size_t> used_bytes = 0;
+	std::atomic<u32> history_count = 0; // Histories sharing this budget
+	size_t budget_bytes;
+
+	UndoBudget(size_t budget_bytes)
+			: budget_bytes(budget_bytes) {}
+};
+
+// Previous colors of pixels modified by a single session, grouped into snapshots (one per stroke).
+// A position is recorded once per snapshot (first change wins). Finished snapshots are stored
+// as LZ4 compressed per-chunk deltas in a ring, oldest are dropped to stay within memory budgets.
+// While the room budget is exceeded, only histories above their equal share of it are trimmed.
+// Not thread-safe, guarded by the owner.
+struct UndoHistory {
+	// Pixels of a single chunk: delta-encoded u16 pixel indices followed by RGB colors, LZ4 compressed
+	struct ChunkDelta {
+		Int2 chunk_pos;
+		u32 pixel_count;
+		SharedVector<u8> compressed;
+	};
+
+private:
+	struct Snapshot {
+		u32 id = 0;
+		std::vector<ChunkDelta> chunks;
+		size_t bytes = 0;
+	};
+
+	// Chunk modified by the current snapshot
+	struct OpenChunk {
+		Int2 chunk_pos;
+		uniqptr<std::bitset<ChunkImage::size * ChunkImage::size>> recorded;
+		std::vector<u16> indices;
+		std::vector<Color> colors;
+	};
+
+	std::shared_ptr<UndoBudget> room_budget;
+	size_t session_budget_bytes = 0;
+
+	u32 last_id = 0;
+	u32 open_id = 0; // Id of the current snapshot
+
+	// Sealed snapshots ordered by id, ring_start is the oldest one
+	std::vector<Snapshot> ring;
+	u32 ring_start = 0;
+	u32 ring_count = 0;
+
+	// Current snapshot, not compressed yet
+	std::unordered_map<Int2, u32, Int2Hash> open_chunk_indices;
+	std::vector<OpenChunk> open_chunks;
+	size_t open_bytes = 0;
+	bool open_dropped = false; // Exceeded budget, not recorded anymore
+
+	size_t used_bytes = 0;		 // Sealed snapshots + current snapshot
+	size_t reported_bytes = 0; // Part of used_bytes added to room_budget
+	u32 unreported_pixels = 0;
+
+	void seal();
+	// Compresses current snapshot, doesn't clear it
+	void encodeOpen(Snapshot &snapshot);
+	void insertSnapshot(Snapshot &&snapshot);
+	void evictOldest();
+	void dropOpen();
+	void enforceBudget();
+	///@returns session budget, or the equal share of the room budget if the room is over it
+	size_t getBudgetLimit() const;
+	void reportUsage();
+
+public:
+	UndoHistory() = default;
+	~UndoHistory();
+
+	///@param max_snapshots ring size
+	void init(std::shared_ptr<UndoBudget> room_budget, size_t session_budget_bytes, u32 max_snapshots);
+
+	// Starts a new snapshot, the previous one is compressed
+	///@returns id of the new snapshot
+	u32 createSnapshot();
+
+	u32 getSnapshotId() const {
+		return open_id;
+	}
+
+	void addPixel(Int2 global_pos, Color previous);
+
+	// Adds pixels to the snapshot with given id. If a newer snapshot was started since then,
+	// they are stored as a separate snapshot ordered before it (e.g. a fill finishing mid-stroke).
+	void addPixels(u32 snapshot_id, const Int2 *global_positions, const Color *previous, u32 count);
+
+	///@returns false if there is nothing to undo
+	bool popSnapshot(std::vector<ChunkDelta> &out);
+
+	void clear();
+
+	size_t getUsedBytes() const {
+		return used_bytes;
+	}
+
+	static void decodeDelta(const ChunkDelta &delta, std::vector<ChunkPixel> &out);
+};
@@ -15,6 +15,9 @@ struct EventQueue {
 	// function callback, taskID
 	std::deque<std::pair<std::function<void()>, size_t>> queue;
 
+	// Called after every push (outside the queue lock), e.g. to wake up the consumer
+	std::function<void()> on_push;
+
 	uint32_t process(uint32_t max_count = UINT32_MAX) {
 		uint32_t processed = 0;
 		uint32_t i = 0;
@@ -42,9 +45,15 @@ struct EventQueue {
 
 	// Returns task ID
 	size_t push(std::function<void()> callback) {
-		std::lock_guard lock(mtx_queue);
-		queue.push_back({callback, taskIndex});
-		return taskIndex++;
+		size_t id;
+		{
+			std::lock_guard lock(mtx_queue);
+			queue.push_back({callback, taskIndex});
+			id = taskIndex++;
+		}
+		if(on_push)
+			on_push();
+		return id;
 	}
 
 	bool cancelTask(size_t task) {
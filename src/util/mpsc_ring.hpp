@@ -0,0 +1,115 @@
+#pragma once
+
+#include "types.hpp"
+#include <atomic>
+#include <memory>
+
+// Bounded lock-free multi-producer, single-consumer ring queue.
+// Every cell has a sequence number telling whether it is free for the producer
+// of a given position or filled for the consumer (D. Vyukov's bounded queue).
+template <typename T>
+struct MpscRing {
+private:
+	struct Cell {
+		std::atomic<u64> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	u64 mask;
+
+	alignas(64) std::atomic<u64> enqueue_pos = 0;
+	alignas(64) std::atomic<u64> dequeue_pos = 0; // Written by consumer only
+
+	std::atomic<u64> overflow_count = 0;
+	u32 high_water = 0; // Consumer side
+
+public:
+	///@param capacity rounded up to a power of two
+	MpscRing(u32 capacity) {
+		u32 size = 1;
+		while(size < capacity)
+			size *= 2;
+
+		cells.reset(new Cell[size]);
+		mask = size - 1;
+		for(u32 i = 0; i < size; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	u32 getCapacity() const {
+		return mask + 1;
+	}
+
+	///@returns false if the queue is full (item is not consumed)
+	bool tryPush(T &&item) {
+		Cell *cell;
+		u64 pos = enqueue_pos.load(std::memory_order_relaxed);
+		while(true) {
+			cell = &cells[pos & mask];
+			u64 seq = cell->sequence.load(std::memory_order_acquire);
+			s64 diff = (s64)(seq - pos);
+			if(diff == 0) {
+				if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if(diff < 0) {
+				overflow_count.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			} else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = std::move(item);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool tryPush(const T &item) {
+		T copy = item;
+		return tryPush(std::move(copy));
+	}
+
+	/// Pops up to max_count items in FIFO order, calling callback(T &item) for each. Consumer thread only.
+	///@returns number of popped items
+	template <typename Callback>
+	u32 drain(Callback &&callback, u32 max_count = UINT32_MAX) {
+		u64 pos = dequeue_pos.load(std::memory_order_relaxed);
+
+		u32 depth = enqueue_pos.load(std::memory_order_relaxed) - pos;
+		if(depth > high_water)
+			high_water = depth;
+
+		u32 count = 0;
+		while(count < max_count) {
+			auto &cell = cells[pos & mask];
+			u64 seq = cell.sequence.load(std::memory_order_acquire);
+			if((s64)(seq - (pos + 1)) < 0)
+				break; // Empty, or the producer of this position didn't finish yet
+
+			T item = std::move(cell.data);
+			cell.data = T();
+			cell.sequence.store(pos + mask + 1, std::memory_order_release);
+			dequeue_pos.store(++pos, std::memory_order_relaxed);
+
+			callback(item);
+			count++;
+		}
+		return count;
+	}
+
+	// Approximate when called concurrently with producers
+	u32 size() const {
+		return enqueue_pos.load(std::memory_order_relaxed) - dequeue_pos.load(std::memory_order_relaxed);
+	}
+
+	struct Stats {
+		u32 depth;
+		u32 high_water; // Max depth seen by the consumer
+		u64 overflows;	// Rejected pushes
+	};
+
+	Stats getStats() const {
+		return {size(), high_water, overflow_count.load(std::memory_order_relaxed)};
+	}
+};
@@ -0,0 +1,226 @@
+#include "pixel_kernels.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// Pixel i of a byte mask (bit per byte) covers bits 3i, 3i+1 and 3i+2.
+// Collapses up to 21 pixels into bits of pixel mask, cost depends on changed pixels only.
+static inline u32 collapseByteMask(u64 byte_mask) {
+	u32 pixel_mask = 0;
+	while(byte_mask) {
+		u32 pixel = __builtin_ctzll(byte_mask) / 3;
+		pixel_mask |= 1u << pixel;
+		byte_mask &= ~(7ull << (pixel * 3));
+	}
+	return pixel_mask;
+}
+
+static inline void setMaskBits(u64 *mask, u32 first_pixel, u32 bits) {
+	// first_pixel is a multiple of 16, bits never cross a word
+	mask[first_pixel / 64] |= (u64)bits << (first_pixel % 64);
+}
+
+//==============================================================================
+// Scalar
+//==============================================================================
+
+static void rgbFillScalar(u8 *rgb, u32 pixel_count, Color color) {
+	for(u32 i = 0; i < pixel_count; i++) {
+		rgb[i * 3 + 0] = color.r;
+		rgb[i * 3 + 1] = color.g;
+		rgb[i * 3 + 2] = color.b;
+	}
+}
+
+static bool rgbIsUniformScalar(const u8 *rgb, u32 pixel_count, Color color) {
+	for(u32 i = 0; i < pixel_count; i++) {
+		if(rgb[i * 3 + 0] != color.r || rgb[i * 3 + 1] != color.g || rgb[i * 3 + 2] != color.b)
+			return false;
+	}
+	return true;
+}
+
+static u32 rgbDiffMaskScalar(const u8 *a, const u8 *b, u32 pixel_count, u64 *mask, u32 first = 0) {
+	u32 changed = 0;
+	for(u32 i = first; i < pixel_count; i++) {
+		if(a[i * 3 + 0] != b[i * 3 + 0] || a[i * 3 + 1] != b[i * 3 + 1] || a[i * 3 + 2] != b[i * 3 + 2]) {
+			mask[i / 64] |= 1ull << (i % 64);
+			changed++;
+		}
+	}
+	return changed;
+}
+
+//==============================================================================
+// SSE2 (16 pixels = 3 vectors per iteration)
+//==============================================================================
+
+#ifdef PIXEL_KERNELS_X86
+
+// 16 pixels of a single color
+static inline void makePattern48(u8 *pattern, Color color) {
+	rgbFillScalar(pattern, 16, color);
+}
+
+__attribute__((target("sse2"))) static bool rgbIsUniformSSE2(const u8 *rgb, u32 pixel_count, Color color) {
+	alignas(16) u8 pattern[48];
+	makePattern48(pattern, color);
+	auto p0 = _mm_load_si128((const __m128i *)(pattern + 0));
+	auto p1 = _mm_load_si128((const __m128i *)(pattern + 16));
+	auto p2 = _mm_load_si128((const __m128i *)(pattern + 32));
+
+	u32 i = 0;
+	for(; i + 16 <= pixel_count; i += 16) {
+		auto *src = rgb + i * 3;
+		auto e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + 0)), p0);
+		auto e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), p1);
+		auto e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + 32)), p2);
+		if(_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1), e2)) != 0xFFFF)
+			return false;
+	}
+	return rgbIsUniformScalar(rgb + i * 3, pixel_count - i, color);
+}
+
+__attribute__((target("sse2"))) static u32 rgbDiffMaskSSE2(const u8 *a, const u8 *b, u32 pixel_count, u64 *mask) {
+	u32 changed = 0;
+	u32 i = 0;
+	for(; i + 16 <= pixel_count; i += 16) {
+		auto *pa = a + i * 3;
+		auto *pb = b + i * 3;
+		u64 equal = (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + 0)), _mm_loadu_si128((const __m128i *)(pb + 0))));
+		equal |= (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + 16)), _mm_loadu_si128((const __m128i *)(pb + 16)))) << 16;
+		equal |= (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + 32)), _mm_loadu_si128((const __m128i *)(pb + 32)))) << 32;
+
+		u64 byte_diff = ~equal & 0xFFFFFFFFFFFFull;
+		if(byte_diff) {
+			u32 bits = collapseByteMask(byte_diff);
+			setMaskBits(mask, i, bits);
+			changed += __builtin_popcount(bits);
+		}
+	}
+	return changed + rgbDiffMaskScalar(a, b, pixel_count, mask, i);
+}
+
+//==============================================================================
+// AVX2 (32 pixels = 3 vectors per iteration)
+//==============================================================================
+
+__attribute__((target("avx2"))) static bool rgbIsUniformAVX2(const u8 *rgb, u32 pixel_count, Color color) {
+	alignas(32) u8 pattern[96];
+	rgbFillScalar(pattern, 32, color);
+	auto p0 = _mm256_load_si256((const __m256i *)(pattern + 0));
+	auto p1 = _mm256_load_si256((const __m256i *)(pattern + 32));
+	auto p2 = _mm256_load_si256((const __m256i *)(pattern + 64));
+
+	u32 i = 0;
+	for(; i + 32 <= pixel_count; i += 32) {
+		auto *src = rgb + i * 3;
+		auto e0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(src + 0)), p0);
+		auto e1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(src + 32)), p1);
+		auto e2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(src + 64)), p2);
+		if((u32)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(e0, e1), e2)) != 0xFFFFFFFFu)
+			return false;
+	}
+	return rgbIsUniformSSE2(rgb + i * 3, pixel_count - i, color);
+}
+
+__attribute__((target("avx2"))) static u32 rgbDiffMaskAVX2(const u8 *a, const u8 *b, u32 pixel_count, u64 *mask) {
+	u32 changed = 0;
+	u32 i = 0;
+	for(; i + 32 <= pixel_count; i += 32) {
+		auto *pa = a + i * 3;
+		auto *pb = b + i * 3;
+		u32 e0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pa + 0)), _mm256_loadu_si256((const __m256i *)(pb + 0))));
+		u32 e1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pa + 32)), _mm256_loadu_si256((const __m256i *)(pb + 32))));
+		u32 e2 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(pa + 64)), _mm256_loadu_si256((const __m256i *)(pb + 64))));
+		if((e0 & e1 & e2) == 0xFFFFFFFFu)
+			continue; // Common case, nothing changed
+
+		// Split 96 byte bits into two halves of 16 pixels (48 bits)
+		u64 low = ~((u64)e0 | ((u64)(e1 & 0xFFFF) << 32)) & 0xFFFFFFFFFFFFull;
+		u64 high = ~((u64)(e1 >> 16) | ((u64)e2 << 16)) & 0xFFFFFFFFFFFFull;
+		u32 bits = collapseByteMask(low) | (collapseByteMask(high) << 16);
+		setMaskBits(mask, i, bits);
+		changed += __builtin_popcount(bits);
+	}
+	return changed + rgbDiffMaskScalar(a, b, pixel_count, mask, i);
+}
+
+#endif
+
+//==============================================================================
+// Dispatch
+//==============================================================================
+
+struct PixelKernels {
+	const char *name;
+	bool (*is_uniform)(const u8 *rgb, u32 pixel_count, Color color);
+	u32 (*diff_mask)(const u8 *a, const u8 *b, u32 pixel_count, u64 *mask);
+};
+
+static u32 rgbDiffMaskScalarEntry(const u8 *a, const u8 *b, u32 pixel_count, u64 *mask) {
+	return rgbDiffMaskScalar(a, b, pixel_count, mask);
+}
+
+static PixelKernels selectPixelKernels() {
+#ifdef PIXEL_KERNELS_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return {"avx2", rgbIsUniformAVX2, rgbDiffMaskAVX2};
+	if(__builtin_cpu_supports("sse2"))
+		return {"sse2", rgbIsUniformSSE2, rgbDiffMaskSSE2};
+#endif
+	return {"scalar", rgbIsUniformScalar, rgbDiffMaskScalarEntry};
+}
+
+static const PixelKernels &getKernels() {
+	static const PixelKernels kernels = selectPixelKernels();
+	return kernels;
+}
+
+void rgbFill(u8 *rgb, u32 pixel_count, Color color) {
+	// Plain stores, vectorized by the compiler (hand-written SSE2/AVX2 versions were not faster)
+	rgbFillScalar(rgb, pixel_count, color);
+}
+
+bool rgbIsUniform(const u8 *rgb, u32 pixel_count, Color color) {
+	return getKernels().is_uniform(rgb, pixel_count, color);
+}
+
+u32 rgbDiffMask(const u8 *a, const u8 *b, u32 pixel_count, u64 *mask) {
+	memset(mask, 0, ((pixel_count + 63) / 64) * sizeof(u64));
+	return getKernels().diff_mask(a, b, pixel_count, mask);
+}
+
+u32 rgbCaptureChanged(const u8 *old_rgb, const u8 *new_rgb, u32 pixel_count, u32 *indices, u8 *captured_rgb) {
+	static constexpr u32 batch = 1024;
+	u64 mask[batch / 64];
+
+	u32 changed = 0;
+	for(u32 first = 0; first < pixel_count; first += batch) {
+		u32 count = std::min(batch, pixel_count - first);
+		if(!rgbDiffMask(old_rgb + first * 3, new_rgb + first * 3, count, mask))
+			continue;
+
+		for(u32 word = 0; word < (count + 63) / 64; word++) {
+			u64 bits = mask[word];
+			while(bits) {
+				u32 index = first + word * 64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+
+				indices[changed] = index;
+				memcpy(captured_rgb + changed * 3, old_rgb + index * 3, 3);
+				changed++;
+			}
+		}
+	}
+	return changed;
+}
+
+const char *getPixelKernelsName() {
+	return getKernels().name;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "../color.hpp"
+#include "types.hpp"
+
+// Operations on packed RGB spans (3 bytes per pixel).
+// Fastest available implementation of compare kernels (AVX2, SSE2 or scalar) is selected at runtime.
+
+// Arrays of Color can be passed as RGB spans
+static_assert(sizeof(Color) == 3);
+
+/// Sets every pixel of the span to color
+void rgbFill(u8 *rgb, u32 pixel_count, Color color);
+
+///@returns true if every pixel of the span equals color
+bool rgbIsUniform(const u8 *rgb, u32 pixel_count, Color color);
+
+/// Compares two spans, sets bit (i % 64) of mask[i / 64] if pixel i differs.
+/// mask has to hold (pixel_count + 63) / 64 words.
+///@returns number of changed pixels
+u32 rgbDiffMask(const u8 *a, const u8 *b, u32 pixel_count, u64 *mask);
+
+/// For every pixel which differs between old_rgb and new_rgb, stores its index and old color (history capture).
+/// indices and captured_rgb have to hold pixel_count entries (pixel_count * 3 bytes).
+///@returns number of changed pixels
+u32 rgbCaptureChanged(const u8 *old_rgb, const u8 *new_rgb, u32 pixel_count, u32 *indices, u8 *captured_rgb);
+
+///@returns name of the selected implementation ("avx2", "sse2" or "scalar")
+const char *getPixelKernelsName();
@@ -0,0 +1,94 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(u32 thread_count) {
+	for(u32 i = 0; i < thread_count; i++) {
+		threads.emplace_back([this] {
+			worker();
+		});
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock lock(mtx_tasks);
+		running = false;
+	}
+	cond_tasks.notify_all();
+
+	for(auto &thr : threads)
+		thr.join();
+}
+
+void ThreadPool::worker() {
+	while(true) {
+		std::function<void()> task;
+		{
+			std::unique_lock lock(mtx_tasks);
+			cond_tasks.wait(lock, [this] {
+				return !tasks.empty() || !running;
+			});
+
+			if(tasks.empty())
+				return; // Stopped and nothing left to do
+
+			task = std::move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}
+
+void ThreadPool::post(std::function<void()> task) {
+	{
+		std::unique_lock lock(mtx_tasks);
+		tasks.push(std::move(task));
+	}
+	cond_tasks.notify_one();
+}
+
+void ThreadPool::parallelFor(u32 count, const std::function<void(u32 index)> &callback) {
+	if(count == 0)
+		return;
+
+	struct Job {
+		std::atomic<u32> next_index = 0;
+		std::mutex mtx;
+		std::condition_variable cond_done;
+		u32 done_count = 0;
+	};
+
+	// Helpers which start after all indices were taken only touch the job, never the callback
+	auto job = std::make_shared<Job>();
+	auto *callback_ptr = &callback;
+
+	auto run = [job, count, callback_ptr] {
+		u32 index;
+		u32 done = 0;
+		while((index = job->next_index.fetch_add(1, std::memory_order_relaxed)) < count) {
+			(*callback_ptr)(index);
+			done++;
+		}
+
+		if(done) {
+			std::unique_lock lock(job->mtx);
+			job->done_count += done;
+			if(job->done_count == count)
+				job->cond_done.notify_one();
+		}
+	};
+
+	u32 helper_count = std::min((u32)threads.size(), count - 1);
+	for(u32 i = 0; i < helper_count; i++)
+		post(run);
+
+	run();
+
+	// Wait for helpers still executing their last callback
+	std::unique_lock lock(job->mtx);
+	job->cond_done.wait(lock, [&] {
+		return job->done_count == count;
+	});
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "types.hpp"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads executing queued tasks in FIFO order
+struct ThreadPool {
+private:
+	std::mutex mtx_tasks;
+	std::condition_variable cond_tasks;
+	std::queue<std::function<void()>> tasks;
+	bool running = true;
+	std::vector<std::thread> threads;
+
+	void worker();
+
+public:
+	ThreadPool(u32 thread_count);
+
+	// Finishes queued tasks before returning
+	~ThreadPool();
+
+	u32 getThreadCount() const {
+		return threads.size();
+	}
+
+	void post(std::function<void()> task);
+
+	/// Calls callback(index) for every index in [0, count) on worker threads,
+	/// calling thread helps with the work. Returns after all calls are done.
+	void parallelFor(u32 count, const std::function<void(u32 index)> &callback);
+};
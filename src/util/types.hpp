@@ -112,7 +112,7 @@ struct Int2 {
 	Int2(s32 n) : x(n), y(n) {}
 	Int2(s32 x, s32 y) : x(x), y(y) {}
 
-	bool operator==(Int2 n) {
+	bool operator==(Int2 n) const {
 		return n.x == this->x && n.y == this->y;
 	}
 
@@ -121,6 +121,15 @@ struct Int2 {
 	}
 };
 
+// For unordered containers keyed by position
+struct Int2Hash {
+	size_t operator()(Int2 n) const {
+		u64 key = ((u64)(u32)n.x << 32) | (u64)(u32)n.y;
+		key *= 0x9e3779b97f4a7c15ull; // Fibonacci hashing, spreads neighbouring positions
+		return (size_t)(key ^ (key >> 32));
+	}
+};
+
 struct UInt2 {
 	u32 x;
 	u32 y;
@@ -61,6 +61,14 @@ const char *WsConnection::getIP() {
 	return p->ip.c_str();
 }
 
+size_t WsConnection::getBufferedAmount() {
+	websocketpp::lib::error_code ec;
+	auto con = p->server->server.get_con_from_hdl(p->hdl, ec);
+	if(ec)
+		return 0; // Closed
+	return con->get_buffered_amount();
+}
+
 void onMessage(WsServer::P *p, websocketpp::connection_hdl hdl, message_ptr data) {
 	auto msg = std::make_shared<WsMessage>();
 	auto con = p->getConnection(hdl);
@@ -16,6 +16,9 @@ struct WsConnection {
 	void send(const uniqdata<u8> &data);
 	void close();
 	const char *getIP();
+
+	///@returns bytes queued for sending (not written to the socket yet)
+	size_t getBufferedAmount();
 };
 
 typedef std::shared_ptr<WsConnection> SharedWsConnection;
@@ -100,6 +100,21 @@ class Chunk {
 		this.updateTexture(gl);
 	}
 
+	putRect(gl: WebGL2RenderingContext, x: number, y: number, width: number, height: number, rgb: Uint8Array) {
+		this.initTexture(gl);
+
+		// Apply older queued pixels first
+		this.processPixels(gl);
+
+		let data = this.pixels!;
+		for (let row = 0; row < height; row++) {
+			let src = row * width * 3;
+			data.set(rgb.subarray(src, src + width * 3), (y + row) * CHUNK_SIZE * 3 + x * 3);
+		}
+
+		this.updateTexture(gl);
+	}
+
 	processPixels(gl: WebGL2RenderingContext) {
 		let count = this.pixel_queue.length;
 
@@ -26,7 +26,7 @@ const MessageType = {
 
 enum ClientCmd {
 	message = 1,	// utf-8 text
-	announce = 2, // u8 room_name_size, utf-8 room_name, u8 nickname_size, utf-8 nickname
+	announce = 2, // u8 room_name_size, utf-8 room_name, u8 nickname_size, utf-8 nickname, u8 capabilities (ClientCapability flags)
 	ping = 4,
 	cursor_pos = 100, // s32 x, s32 y
 	cursor_down = 101,
@@ -40,12 +40,19 @@ enum ClientCmd {
 	undo = 203
 }
 
+// Optional protocol features supported by this client
+enum ClientCapability {
+	batch_frames = 1 // Understands ServerCmd.batch
+}
+
 enum ServerCmd {
 	message = 1,						// u8 type, utf-8 text
 	your_id = 2,						// u16 id
 	kick = 3,								// utf-8 reason
+	batch = 4,							// repeated: u32 size, packet (u16 command + data)
 	chunk_image = 100,			// complex data
 	chunk_pixel_pack = 101, // complex data
+	chunk_rect_pack = 102,	// s32 chunkX, s32 chunkY, u16 x, u16 y, u16 width, u16 height, LZ4 compressed RGB rows
 	chunk_create = 110,			// s32 chunkX, s32 chunkY
 	chunk_remove = 111,			// s32 chunkX, s32 chunkY
 	preview_image = 200,		// s32 previewX, s32 previewY, u8 zoom, complex data
@@ -145,7 +152,7 @@ export class Client {
 		let nickname_utf8_size = nickname_utf8.length;
 
 		let buf = createMessage(ClientCmd.announce,
-			1 + room_name_utf8_size + 1 + nickname_utf8_size);
+			1 + room_name_utf8_size + 1 + nickname_utf8_size + 1);
 
 		let buf_u8 = new Uint8Array(buf);
 
@@ -163,6 +170,8 @@ export class Client {
 			buf_u8[offset++] = nickname_utf8[i];
 		}
 
+		buf_u8[offset++] = ClientCapability.batch_frames;
+
 		this.socket!.send(buf);
 	}
 
@@ -263,7 +272,10 @@ export class Client {
 	}
 
 	onmessage(e: MessageEvent<any>) {
-		let raw_data = e.data;
+		this.handlePacket(e.data);
+	}
+
+	handlePacket(raw_data: ArrayBuffer) {
 		let headerview = new DataView(raw_data, 0);
 
 		function createView(offset: number) {
@@ -277,6 +289,15 @@ export class Client {
 		let map = this.multipixel.map;
 
 		switch (command) {
+			case ServerCmd.batch: {
+				let offset = header_offset;
+				while (offset + size_u32 <= raw_data.byteLength) {
+					let size = headerview.getUint32(offset); offset += size_u32;
+					this.handlePacket(raw_data.slice(offset, offset + size));
+					offset += size;
+				}
+				break;
+			}
 			case ServerCmd.message: {
 				let type = dataview.getUint8(0);
 				let view_str = createView(1);
@@ -354,6 +375,28 @@ export class Client {
 
 				break;
 			}
+			case ServerCmd.chunk_rect_pack: {
+				let offset = 0;
+
+				let chunk_x = dataview.getInt32(offset); offset += 4;
+				let chunk_y = dataview.getInt32(offset); offset += 4;
+				let rect_x = dataview.getUint16(offset); offset += 2;
+				let rect_y = dataview.getUint16(offset); offset += 2;
+				let rect_width = dataview.getUint16(offset); offset += 2;
+				let rect_height = dataview.getUint16(offset); offset += 2;
+
+				let uncompressed_buffer = Buffer.alloc(rect_width * rect_height * 3);
+				let compressed_data = raw_data.slice(header_offset + offset);
+				LZ4.decodeBlock(Buffer.from(compressed_data), uncompressed_buffer);
+
+				let chunk = map.getChunk(chunk_x, chunk_y);
+				if (chunk) {
+					chunk.putRect(this.multipixel.getRenderer().getContext(), rect_x, rect_y, rect_width, rect_height, new Uint8Array(uncompressed_buffer));
+					map.triggerRerender();
+				}
+
+				break;
+			}
 			case ServerCmd.chunk_create: {
 				let chunkX = dataview.getInt32(0);
 				let chunkY = dataview.getInt32(4);
@@ -387,7 +430,7 @@ export class Client {
 			}
 			case ServerCmd.user_create: {
 				let id = dataview.getUint16(0);
-				let nickname = new TextDecoder().decode(new DataView(e.data, header_offset + size_u16));
+				let nickname = new TextDecoder().decode(new DataView(raw_data, header_offset + size_u16));
 				this.users[id] = new User(id, nickname);
 				this.multipixel.updatePlayerList();
 				map.triggerRerender();
@@ -414,7 +457,7 @@ export class Client {
 				break;
 			}
 			case ServerCmd.processing_status_text: {
-				let status_text = new TextDecoder().decode(new DataView(e.data, header_offset));
+				let status_text = new TextDecoder().decode(new DataView(raw_data, header_offset));
 				this.multipixel.setProcessingStatusText(status_text);
 				break;
 			}